@@ -0,0 +1,178 @@
+#include "FrameArena.h"
+#include "Threads.h"
+
+#include <stdlib.h>
+
+#define FRAME_ARENA_BASE_ALIGN 64
+#define FRAME_ARENA_CHUNK (16 * 1024)
+
+struct FallbackBlock
+{
+    FallbackBlock * next;
+};
+
+struct FrameArena
+{
+    char * memory;
+    char * base;
+    size_t capacity;
+    volatile long offset;
+    volatile long fallbackCount;
+    volatile long fallbackBytes;
+    FallbackBlock * fallbacks;
+    volatile long fallbackLock;
+};
+
+// threads carve small requests out of a private chunk of the current arena
+// and only touch the shared offset to grab the next chunk
+struct FrameChunk
+{
+    char * next;
+    char * end;
+    long generation;
+};
+
+static FrameArena arenas[FRAME_ARENA_COUNT];
+static int current = 0;
+static long frame = 0;
+static volatile long generation = 1;
+static THREAD_LOCAL FrameChunk chunk = { NULL, NULL, 0 };
+static size_t highWater = 0;
+static long totalFallbackCount = 0;
+
+static size_t AlignUp(size_t x, size_t align)
+{
+    return (x + align - 1) & ~(align - 1);
+}
+
+static void RewindArena(FrameArena * arena)
+{
+    if((size_t)arena->offset > highWater)
+        highWater = arena->offset;
+    totalFallbackCount += arena->fallbackCount;
+    FallbackBlock * block = arena->fallbacks;
+    while(block)
+    {
+        FallbackBlock * next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->fallbacks = NULL;
+    arena->offset = 0;
+    AtomicIncrement(&generation);
+    arena->fallbackCount = 0;
+    arena->fallbackBytes = 0;
+}
+
+bool InitFrameArenas(size_t capacity)
+{
+    ShutdownFrameArenas();
+    for(int i = 0; i < FRAME_ARENA_COUNT; ++i)
+    {
+        char * memory = (char*)malloc(capacity + FRAME_ARENA_BASE_ALIGN);
+        if(!memory)
+        {
+            ShutdownFrameArenas();
+            return false;
+        }
+        arenas[i].memory = memory;
+        arenas[i].base = (char*)AlignUp((size_t)memory, FRAME_ARENA_BASE_ALIGN);
+        arenas[i].capacity = capacity;
+    }
+    return true;
+}
+
+void ShutdownFrameArenas()
+{
+    for(int i = 0; i < FRAME_ARENA_COUNT; ++i)
+    {
+        RewindArena(&arenas[i]);
+        free(arenas[i].memory);
+        arenas[i].memory = NULL;
+        arenas[i].base = NULL;
+        arenas[i].capacity = 0;
+    }
+    current = 0;
+    frame = 0;
+    highWater = 0;
+    totalFallbackCount = 0;
+}
+
+void BeginFrameArena()
+{
+    current = (current + 1) % FRAME_ARENA_COUNT;
+    RewindArena(&arenas[current]);
+    ++frame;
+}
+
+static void * FallbackAlloc(FrameArena * arena, size_t size, size_t align)
+{
+    FallbackBlock * block = (FallbackBlock*)malloc(sizeof(FallbackBlock) + align + size);
+    if(!block)
+        return NULL;
+    while(AtomicCompareExchange(&arena->fallbackLock, 1, 0) != 0)
+        YieldThread();
+    block->next = arena->fallbacks;
+    arena->fallbacks = block;
+    MemoryFence();
+    arena->fallbackLock = 0;
+    AtomicIncrement(&arena->fallbackCount);
+    AtomicAdd(&arena->fallbackBytes, (long)size);
+    return (void*)AlignUp((size_t)(block + 1), align);
+}
+
+static void * SharedAlloc(FrameArena * arena, size_t size, size_t align)
+{
+    for(;;)
+    {
+        long offset = arena->offset;
+        size_t start = AlignUp(offset, align);
+        size_t end = start + size;
+        if(end > arena->capacity)
+            break;
+        if(AtomicCompareExchange(&arena->offset, (long)end, offset) == offset)
+            return arena->base + start;
+    }
+    return NULL;
+}
+
+void * FrameAlloc(size_t size, size_t align)
+{
+    FrameArena * arena = &arenas[current];
+    if(size <= FRAME_ARENA_CHUNK / 4)
+    {
+        if(chunk.generation == generation)
+        {
+            char * p = (char*)AlignUp((size_t)chunk.next, align);
+            if(p + size <= chunk.end)
+            {
+                chunk.next = p + size;
+                return p;
+            }
+        }
+        long g = generation;
+        char * block = (char*)SharedAlloc(arena, FRAME_ARENA_CHUNK, FRAME_ARENA_BASE_ALIGN);
+        if(block)
+        {
+            char * p = (char*)AlignUp((size_t)block, align);
+            chunk.next = p + size;
+            chunk.end = block + FRAME_ARENA_CHUNK;
+            chunk.generation = g;
+            return p;
+        }
+    }
+    void * p = SharedAlloc(arena, size, align);
+    return p ? p : FallbackAlloc(arena, size, align);
+}
+
+void GetFrameArenaStats(FrameArenaStats * stats)
+{
+    const FrameArena * arena = &arenas[current];
+    stats->capacity = arena->capacity;
+    stats->used = arena->offset;
+    stats->highWater = stats->used > highWater ? stats->used : highWater;
+    stats->fallbackCount = arena->fallbackCount;
+    stats->fallbackBytes = arena->fallbackBytes;
+    stats->totalFallbackCount = totalFallbackCount + arena->fallbackCount;
+    stats->frame = frame;
+}
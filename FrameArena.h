@@ -0,0 +1,88 @@
+#ifndef REEF_FRAME_ARENA_H
+#define REEF_FRAME_ARENA_H
+
+#include <stddef.h>
+#include <new>
+
+// Bump allocator for memory that lives until the end of the frame. There is
+// one arena per frame in flight; BeginFrameArena moves on to the oldest one
+// and rewinds it. Allocation is lock-free, so jobs may use it as well.
+// Requests that do not fit go to the heap, are counted, and are released
+// when their arena is rewound. Nothing may be allocated before the first
+// BeginFrameArena: that memory would be rewound by the second frame, so
+// init-time data belongs on the heap.
+
+#define FRAME_ARENA_COUNT 2
+#define FRAME_ARENA_ALIGN 16
+
+struct FrameArenaStats
+{
+    size_t capacity;
+    size_t used;
+    size_t highWater;
+    long fallbackCount;
+    size_t fallbackBytes;
+    long totalFallbackCount;
+    long frame;
+};
+
+bool InitFrameArenas(size_t capacity);
+void ShutdownFrameArenas();
+void BeginFrameArena();
+void * FrameAlloc(size_t size, size_t align = FRAME_ARENA_ALIGN);
+// Stats of the current frame; highWater covers every frame so far.
+void GetFrameArenaStats(FrameArenaStats * stats);
+
+// STL allocator over the current frame arena. Memory is reclaimed with the
+// frame, so containers using it must not outlive the frame; reserve up front,
+// as blocks left behind by growth are not reused.
+template<class T>
+class FrameAllocator
+{
+public:
+    typedef T value_type;
+    typedef T * pointer;
+    typedef const T * const_pointer;
+    typedef T & reference;
+    typedef const T & const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template<class U>
+    struct rebind
+    {
+        typedef FrameAllocator<U> other;
+    };
+
+    FrameAllocator() {}
+    FrameAllocator(const FrameAllocator &) {}
+    template<class U>
+    FrameAllocator(const FrameAllocator<U> &) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void * = 0)
+    {
+        size_type align = __alignof(T) > FRAME_ARENA_ALIGN ? __alignof(T) : FRAME_ARENA_ALIGN;
+        void * p = FrameAlloc(n * sizeof(T), align);
+        if(!p)
+            throw std::bad_alloc();
+        return (pointer)p;
+    }
+
+    void deallocate(pointer, size_type) {}
+
+    void construct(pointer p, const T & value) { new((void*)p) T(value); }
+    void destroy(pointer p) { p->~T(); }
+
+    size_type max_size() const { return (size_type)-1 / sizeof(T); }
+};
+
+template<class T, class U>
+bool operator==(const FrameAllocator<T> &, const FrameAllocator<U> &) { return true; }
+
+template<class T, class U>
+bool operator!=(const FrameAllocator<T> &, const FrameAllocator<U> &) { return false; }
+
+#endif
@@ -0,0 +1,498 @@
+#include "Jobs.h"
+
+#include <string.h>
+
+#define JOB_QUEUE_MASK (JOB_QUEUE_SIZE - 1)
+#define JOB_POOL_MASK (JOB_POOL_SIZE - 1)
+#define JOB_SPIN_COUNT 64
+#define JOB_CACHE_LINE 64
+
+struct Worker;
+
+struct Job
+{
+    JobProc proc;
+    void * data;
+    JobCounter * counter;
+    Job * next;
+    ParallelForProc rangeProc;
+    void * rangeContext;
+    int begin;
+    int end;
+    int grain;
+    volatile long busy;
+    // set on overflow records, which go back to their worker's free list
+    Worker * overflowOwner;
+    long overflowNext;
+};
+
+// top is moved by thieves, bottom only by the owner; keep them apart
+struct Worker
+{
+    volatile long top;
+    char topPad[JOB_CACHE_LINE - sizeof(long)];
+    volatile long bottom;
+    char bottomPad[JOB_CACHE_LINE - sizeof(long)];
+    Job * volatile queue[JOB_QUEUE_SIZE];
+    Job pool[JOB_POOL_SIZE];
+    unsigned long poolNext;
+    // free overflow records linked by index, -1 when empty; only the owner
+    // takes records, any worker may give them back
+    Job overflow[JOB_OVERFLOW_SIZE];
+    volatile long overflowFree;
+    unsigned long random;
+    long executed;
+    long stolen;
+    long overflowed;
+    Thread thread;
+};
+
+static Worker * workers = NULL;
+static int workerCount = 0;
+static volatile long quit = 0;
+static volatile long sleepers = 0;
+static Semaphore wakeup;
+static THREAD_LOCAL int workerIndex = -1;
+
+static long QueueSize(const Worker * w)
+{
+    return (long)((unsigned long)w->bottom - (unsigned long)w->top);
+}
+
+static bool PushJob(Worker * w, Job * job)
+{
+    unsigned long b = w->bottom;
+    unsigned long t = w->top;
+    if((long)(b - t) >= JOB_QUEUE_SIZE)
+        return false;
+    w->queue[b & JOB_QUEUE_MASK] = job;
+    MemoryFence();
+    w->bottom = (long)(b + 1);
+    return true;
+}
+
+static Job * PopJob(Worker * w)
+{
+    unsigned long b = (unsigned long)w->bottom - 1;
+    w->bottom = (long)b;
+    MemoryFence();
+    unsigned long t = w->top;
+    long size = (long)(b - t);
+    if(size < 0)
+    {
+        w->bottom = (long)t;
+        return NULL;
+    }
+    Job * job = w->queue[b & JOB_QUEUE_MASK];
+    if(size > 0)
+        return job;
+    // last job: race the thieves for it
+    if(AtomicCompareExchange(&w->top, (long)(t + 1), (long)t) != (long)t)
+        job = NULL;
+    w->bottom = (long)(t + 1);
+    return job;
+}
+
+static Job * StealJob(Worker * w)
+{
+    unsigned long t = w->top;
+    MemoryFence();
+    unsigned long b = w->bottom;
+    if((long)(b - t) <= 0)
+        return NULL;
+    Job * job = w->queue[t & JOB_QUEUE_MASK];
+    if(AtomicCompareExchange(&w->top, (long)(t + 1), (long)t) != (long)t)
+        return NULL;
+    return job;
+}
+
+static Job * GetJob(int self)
+{
+    Worker * w = &workers[self];
+    Job * job = PopJob(w);
+    if(job)
+        return job;
+    w->random ^= w->random << 13;
+    w->random ^= w->random >> 17;
+    w->random ^= w->random << 5;
+    int start = (int)(w->random % workerCount);
+    for(int i = 0; i < workerCount; ++i)
+    {
+        int victim = (start + i) % workerCount;
+        if(victim == self)
+            continue;
+        job = StealJob(&workers[victim]);
+        if(job)
+        {
+            ++w->stolen;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static bool HasQueuedJobs()
+{
+    for(int i = 0; i < workerCount; ++i)
+        if(QueueSize(&workers[i]) > 0)
+            return true;
+    return false;
+}
+
+static void LockCounter(JobCounter * counter)
+{
+    while(AtomicCompareExchange(&counter->lock, 1, 0) != 0)
+        YieldThread();
+}
+
+static void UnlockCounter(JobCounter * counter)
+{
+    MemoryFence();
+    counter->lock = 0;
+}
+
+static void ExecuteJob(Job * job);
+
+static void SubmitJob(Job * job)
+{
+    int self = workerIndex;
+    if(self < 0 || !PushJob(&workers[self], job))
+    {
+        ExecuteJob(job);
+        return;
+    }
+    MemoryFence();
+    if(sleepers > 0)
+        SignalSemaphore(&wakeup);
+}
+
+static Job * TakeOverflowJob(Worker * w)
+{
+    for(;;)
+    {
+        long head = w->overflowFree;
+        if(head < 0)
+            return NULL;
+        long next = w->overflow[head].overflowNext;
+        if(AtomicCompareExchange(&w->overflowFree, next, head) == head)
+            return &w->overflow[head];
+    }
+}
+
+static void ReleaseOverflowJob(Job * job)
+{
+    Worker * w = job->overflowOwner;
+    long index = (long)(job - w->overflow);
+    for(;;)
+    {
+        long head = w->overflowFree;
+        job->overflowNext = head;
+        if(AtomicCompareExchange(&w->overflowFree, index, head) == head)
+            return;
+    }
+}
+
+static void FinishJob(Job * job)
+{
+    JobCounter * counter = job->counter;
+    MemoryFence();
+    if(job->overflowOwner)
+        ReleaseOverflowJob(job);
+    else
+        job->busy = 0;
+    if(!counter)
+        return;
+    // the counter is only released once the lock is, so waiters can not
+    // return and drop it while we are still releasing its continuations
+    Job * ready = NULL;
+    LockCounter(counter);
+    if(AtomicDecrement(&counter->value) == 0)
+    {
+        ready = counter->waiting;
+        counter->waiting = NULL;
+    }
+    UnlockCounter(counter);
+    while(ready)
+    {
+        Job * next = ready->next;
+        SubmitJob(ready);
+        ready = next;
+    }
+}
+
+static void ExecuteJob(Job * job)
+{
+    job->proc(job->data);
+    if(workerIndex >= 0)
+        ++workers[workerIndex].executed;
+    FinishJob(job);
+}
+
+static Job * AllocJob(int self)
+{
+    Worker * w = &workers[self];
+    Job * job = &w->pool[w->poolNext++ & JOB_POOL_MASK];
+    // The ring has wrapped onto a job still in flight. It may be running
+    // further up this very stack or be parked on a counter only we release,
+    // so waiting for it could hang; take an overflow record instead, or
+    // leave the caller to run the job itself when those are gone as well.
+    if(job->busy)
+    {
+        job = TakeOverflowJob(w);
+        if(!job)
+            return NULL;
+        ++w->overflowed;
+    }
+    job->busy = 1;
+    job->next = NULL;
+    return job;
+}
+
+static void WorkerMain(void * arg)
+{
+    int self = (int)(size_t)arg;
+    workerIndex = self;
+    int idle = 0;
+    while(!quit)
+    {
+        Job * job = GetJob(self);
+        if(job)
+        {
+            ExecuteJob(job);
+            idle = 0;
+            continue;
+        }
+        if(++idle < JOB_SPIN_COUNT)
+        {
+            YieldThread();
+            continue;
+        }
+        AtomicIncrement(&sleepers);
+        if(!quit && !HasQueuedJobs())
+            WaitSemaphore(&wakeup);
+        AtomicDecrement(&sleepers);
+        idle = 0;
+    }
+}
+
+bool InitJobs(int count)
+{
+    if(workers)
+        return false;
+    if(count <= 0)
+        count = GetProcessorCount();
+    if(count > JOB_MAX_WORKERS)
+        count = JOB_MAX_WORKERS;
+    if(!InitSemaphore(&wakeup, JOB_MAX_WORKERS))
+        return false;
+
+    workers = new Worker[count];
+    memset(workers, 0, count * sizeof(Worker));
+    for(int i = 0; i < count; ++i)
+    {
+        Worker * w = &workers[i];
+        w->random = 2463534242UL + i * 7919;
+        for(int j = 0; j < JOB_OVERFLOW_SIZE; ++j)
+        {
+            w->overflow[j].overflowOwner = w;
+            w->overflow[j].overflowNext = j + 1 < JOB_OVERFLOW_SIZE ? j + 1 : -1;
+        }
+        w->overflowFree = 0;
+    }
+    workerCount = 1;
+    quit = 0;
+    sleepers = 0;
+    workerIndex = 0;
+    for(int i = 1; i < count; ++i)
+    {
+        if(!StartThread(&workers[i].thread, WorkerMain, (void*)(size_t)i))
+        {
+            ShutdownJobs();
+            return false;
+        }
+        workerCount = i + 1;
+    }
+    return true;
+}
+
+void ShutdownJobs()
+{
+    if(!workers)
+        return;
+    quit = 1;
+    MemoryFence();
+    for(int i = 1; i < workerCount; ++i)
+        SignalSemaphore(&wakeup);
+    for(int i = 1; i < workerCount; ++i)
+        JoinThread(workers[i].thread);
+    DestroySemaphore(&wakeup);
+    delete [] workers;
+    workers = NULL;
+    workerCount = 0;
+    workerIndex = -1;
+}
+
+int GetJobWorkerCount()
+{
+    return workerCount;
+}
+
+int GetJobWorkerIndex()
+{
+    return workerIndex;
+}
+
+void GetJobStats(JobStats * stats)
+{
+    stats->executed = 0;
+    stats->stolen = 0;
+    stats->overflowed = 0;
+    for(int i = 0; i < workerCount; ++i)
+    {
+        stats->executed += workers[i].executed;
+        stats->stolen += workers[i].stolen;
+        stats->overflowed += workers[i].overflowed;
+    }
+}
+
+void InitJobCounter(JobCounter * counter)
+{
+    counter->value = 0;
+    counter->lock = 0;
+    counter->waiting = NULL;
+}
+
+bool IsJobCounterDone(const JobCounter * counter)
+{
+    return counter->value == 0 && counter->lock == 0;
+}
+
+void RunJob(JobProc proc, void * data, JobCounter * counter, JobCounter * dependency)
+{
+    int self = workerIndex;
+    if(!workers || self < 0)
+    {
+        while(dependency && !IsJobCounterDone(dependency))
+            YieldThread();
+        proc(data);
+        return;
+    }
+    Job * job = AllocJob(self);
+    if(!job)
+    {
+        if(dependency)
+            WaitForJobCounter(dependency);
+        proc(data);
+        return;
+    }
+    job->proc = proc;
+    job->data = data;
+    job->counter = counter;
+    if(counter)
+        AtomicIncrement(&counter->value);
+    if(dependency)
+    {
+        LockCounter(dependency);
+        if(dependency->value != 0)
+        {
+            job->next = dependency->waiting;
+            dependency->waiting = job;
+            UnlockCounter(dependency);
+            return;
+        }
+        UnlockCounter(dependency);
+    }
+    SubmitJob(job);
+}
+
+void WaitForJobCounter(JobCounter * counter)
+{
+    int self = workerIndex;
+    while(!IsJobCounterDone(counter))
+    {
+        Job * job = self >= 0 && workers ? GetJob(self) : NULL;
+        if(job)
+            ExecuteJob(job);
+        else
+            YieldThread();
+    }
+}
+
+static void RunRange(void * data)
+{
+    Job * job = (Job*)data;
+    int self = workerIndex;
+    ParallelForProc proc = job->rangeProc;
+    void * context = job->rangeContext;
+    int begin = job->begin;
+    int end = job->end;
+    int grain = job->grain;
+    while(end - begin > grain)
+    {
+        Job * half = QueueSize(&workers[self]) == 0 ? AllocJob(self) : NULL;
+        if(half)
+        {
+            int mid = begin + (end - begin) / 2;
+            half->proc = RunRange;
+            half->data = half;
+            half->counter = job->counter;
+            half->rangeProc = proc;
+            half->rangeContext = context;
+            half->begin = mid;
+            half->end = end;
+            half->grain = grain;
+            AtomicIncrement(&job->counter->value);
+            SubmitJob(half);
+            end = mid;
+        }
+        else
+        {
+            proc(context, begin, begin + grain);
+            begin += grain;
+        }
+    }
+    proc(context, begin, end);
+}
+
+void ParallelFor(int count, int grain, ParallelForProc proc, void * context)
+{
+    if(count <= 0)
+        return;
+    int self = workerIndex;
+    if(!workers || self < 0 || workerCount == 1)
+    {
+        proc(context, 0, count);
+        return;
+    }
+    if(grain <= 0)
+    {
+        grain = count / (workerCount * 16);
+        if(grain < 1)
+            grain = 1;
+    }
+    if(count <= grain)
+    {
+        proc(context, 0, count);
+        return;
+    }
+
+    JobCounter counter;
+    InitJobCounter(&counter);
+    Job * job = AllocJob(self);
+    if(!job)
+    {
+        proc(context, 0, count);
+        return;
+    }
+    job->proc = RunRange;
+    job->data = job;
+    job->counter = &counter;
+    job->rangeProc = proc;
+    job->rangeContext = context;
+    job->begin = 0;
+    job->end = count;
+    job->grain = grain;
+    AtomicIncrement(&counter.value);
+    ExecuteJob(job);
+    WaitForJobCounter(&counter);
+}
@@ -0,0 +1,60 @@
+#ifndef REEF_JOBS_H
+#define REEF_JOBS_H
+
+#include "Threads.h"
+
+// Work-stealing job scheduler. Every worker owns a fixed-size deque and a
+// ring of job records, so submitting a job never allocates. When more than
+// JOB_POOL_SIZE of a worker's jobs are in flight at once, as with deep
+// nesting, the extra records come from a preallocated overflow list and are
+// counted in JobStats; once that is used up too, jobs run on the spot. The
+// thread that calls InitJobs becomes worker 0 and runs jobs while it waits
+// on a counter.
+
+#define JOB_MAX_WORKERS 64
+#define JOB_QUEUE_SIZE 1024
+#define JOB_POOL_SIZE 1024
+#define JOB_OVERFLOW_SIZE 1024
+
+typedef void (*JobProc)(void * data);
+typedef void (*ParallelForProc)(void * context, int begin, int end);
+
+struct Job;
+
+struct JobCounter
+{
+    volatile long value;
+    volatile long lock;
+    Job * waiting;
+};
+
+struct JobStats
+{
+    long executed;
+    long stolen;
+    long overflowed;
+};
+
+bool InitJobs(int workers = 0);
+void ShutdownJobs();
+int GetJobWorkerCount();
+// -1 on threads the scheduler does not own.
+int GetJobWorkerIndex();
+// Totals are approximate while workers are busy.
+void GetJobStats(JobStats * stats);
+
+void InitJobCounter(JobCounter * counter);
+bool IsJobCounterDone(const JobCounter * counter);
+
+// Queues proc(data). counter, if any, goes up now and down when the job has
+// run; the job is held back until dependency, if any, has dropped to zero.
+void RunJob(JobProc proc, void * data, JobCounter * counter, JobCounter * dependency = NULL);
+// Runs queued jobs on the calling thread until counter drops to zero.
+void WaitForJobCounter(JobCounter * counter);
+
+// Runs proc over [0, count) and returns when all of it is done. A range is
+// halved whenever its worker's deque has been drained by thieves, down to
+// grain items; grain <= 0 derives one from count and the worker count.
+void ParallelFor(int count, int grain, ParallelForProc proc, void * context);
+
+#endif
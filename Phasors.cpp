@@ -0,0 +1,275 @@
+#include "Phasors.h"
+#include "Jobs.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define PHASOR_SSE
+#include <xmmintrin.h>
+#endif
+
+// per-wave factors of cos and sin in the position and normal sums
+enum
+{
+    COEF_POS_X,
+    COEF_POS_Z,
+    COEF_POS_Y,
+    COEF_NORM_X,
+    COEF_NORM_Z,
+    COEF_NORM_Y,
+    COEF_COUNT
+};
+
+#define PHASOR_STRIDE (PHASOR_BLOCK * 2)
+
+static float WaveFrequency(const Wave & wave)
+{
+    return sqrtf(WAVE_G * 2 * WAVE_PI / wave.length);
+}
+
+bool CreateWavePhasors(WavePhasors * phasors, const Wave * waves, int waveCount,
+                       float crestFactor, const float * x, const float * z,
+                       int vertexCount, float time)
+{
+    memset(phasors, 0, sizeof(WavePhasors));
+    if(waveCount <= 0 || vertexCount <= 0)
+        return false;
+    int blocks = (vertexCount + PHASOR_BLOCK - 1) / PHASOR_BLOCK;
+    int padded = blocks * PHASOR_BLOCK;
+    phasors->waveCount = waveCount;
+    phasors->vertexCount = vertexCount;
+    phasors->blockCount = blocks;
+    phasors->crestFactor = crestFactor;
+    phasors->renormalizeInterval = PHASOR_RENORMALIZE_INTERVAL;
+    phasors->resyncInterval = PHASOR_RESYNC_INTERVAL;
+    phasors->x = (float*)AllocAligned(padded * sizeof(float), 16);
+    phasors->z = (float*)AllocAligned(padded * sizeof(float), 16);
+    phasors->state = (float*)AllocAligned((size_t)blocks * waveCount * PHASOR_STRIDE * sizeof(float), 16);
+    phasors->coefficients = (float*)AllocAligned(waveCount * COEF_COUNT * sizeof(float), 16);
+    phasors->rotation = (float*)AllocAligned(waveCount * 2 * sizeof(float), 16);
+    phasors->phase = new double[waveCount];
+    phasors->waves = new Wave[waveCount];
+    if(!phasors->x || !phasors->z || !phasors->state
+       || !phasors->coefficients || !phasors->rotation)
+    {
+        DestroyWavePhasors(phasors);
+        return false;
+    }
+
+    for(int v = 0; v < padded; ++v)
+    {
+        // pad the last block with copies of the last vertex
+        int src = v < vertexCount ? v : vertexCount - 1;
+        phasors->x[v] = x[src];
+        phasors->z[v] = z[src];
+    }
+    for(int w = 0; w < waveCount; ++w)
+    {
+        const Wave & wave = waves[w];
+        phasors->waves[w] = wave;
+        float freq = WaveFrequency(wave);
+        float q = 1 / (wave.amp * freq * waveCount) * crestFactor;
+        float * c = phasors->coefficients + w * COEF_COUNT;
+        c[COEF_POS_X] = q * wave.amp * wave.dir.x;
+        c[COEF_POS_Z] = q * wave.amp * wave.dir.y;
+        c[COEF_POS_Y] = wave.amp;
+        c[COEF_NORM_X] = wave.dir.x * freq * wave.amp;
+        c[COEF_NORM_Z] = wave.dir.y * freq * wave.amp;
+        c[COEF_NORM_Y] = q * freq * wave.amp;
+    }
+    ResyncWavePhasors(phasors, time);
+    return true;
+}
+
+void DestroyWavePhasors(WavePhasors * phasors)
+{
+    if(phasors->x)
+        FreeAligned(phasors->x);
+    if(phasors->z)
+        FreeAligned(phasors->z);
+    if(phasors->state)
+        FreeAligned(phasors->state);
+    if(phasors->coefficients)
+        FreeAligned(phasors->coefficients);
+    if(phasors->rotation)
+        FreeAligned(phasors->rotation);
+    delete [] phasors->phase;
+    delete [] phasors->waves;
+    memset(phasors, 0, sizeof(WavePhasors));
+}
+
+size_t WavePhasorBytes(const WavePhasors * phasors)
+{
+    size_t padded = (size_t)phasors->blockCount * PHASOR_BLOCK;
+    return (size_t)phasors->blockCount * phasors->waveCount * PHASOR_STRIDE * sizeof(float)
+           + padded * 2 * sizeof(float)
+           + phasors->waveCount * (COEF_COUNT * sizeof(float) + 2 * sizeof(float)
+                                   + sizeof(double) + sizeof(Wave));
+}
+
+static void ResyncBlocks(void * context, int begin, int end)
+{
+    WavePhasors * phasors = (WavePhasors*)context;
+    int n = phasors->waveCount;
+    for(int b = begin; b < end; ++b)
+    {
+        for(int w = 0; w < n; ++w)
+        {
+            const Wave & wave = phasors->waves[w];
+            float freq = WaveFrequency(wave);
+            float * s = phasors->state + ((size_t)b * n + w) * PHASOR_STRIDE;
+            for(int l = 0; l < PHASOR_BLOCK; ++l)
+            {
+                int v = b * PHASOR_BLOCK + l;
+                double phase = freq * (wave.dir.x * phasors->x[v] + wave.dir.y * phasors->z[v])
+                               + phasors->phase[w];
+                s[l] = (float)cos(phase);
+                s[PHASOR_BLOCK + l] = (float)sin(phase);
+            }
+        }
+    }
+}
+
+void ResyncWavePhasors(WavePhasors * phasors, float time)
+{
+    for(int w = 0; w < phasors->waveCount; ++w)
+        phasors->phase[w] = WAVE_PHASE * (double)time;
+    ParallelFor(phasors->blockCount, 0, ResyncBlocks, phasors);
+    phasors->frames = 0;
+}
+
+struct PhasorUpdate
+{
+    WavePhasors * phasors;
+    WaveSum * sums;
+    bool renormalize;
+};
+
+static void StoreSums(const WavePhasors * phasors, int block, const float * acc, WaveSum * sums)
+{
+    for(int l = 0; l < PHASOR_BLOCK; ++l)
+    {
+        int v = block * PHASOR_BLOCK + l;
+        if(v >= phasors->vertexCount)
+            break;
+        WaveSum & sum = sums[v];
+        sum.pos[0] = acc[COEF_POS_X * PHASOR_BLOCK + l] + phasors->x[v];
+        sum.pos[1] = acc[COEF_POS_Y * PHASOR_BLOCK + l];
+        sum.pos[2] = acc[COEF_POS_Z * PHASOR_BLOCK + l] + phasors->z[v];
+        float nx = -acc[COEF_NORM_X * PHASOR_BLOCK + l];
+        float ny = 1 - acc[COEF_NORM_Y * PHASOR_BLOCK + l];
+        float nz = -acc[COEF_NORM_Z * PHASOR_BLOCK + l];
+        float len = sqrtf(nx * nx + ny * ny + nz * nz);
+        sum.norm[0] = nx / len;
+        sum.norm[1] = ny / len;
+        sum.norm[2] = nz / len;
+    }
+}
+
+static void UpdateBlocks(void * context, int begin, int end)
+{
+    PhasorUpdate * update = (PhasorUpdate*)context;
+    WavePhasors * phasors = update->phasors;
+    int n = phasors->waveCount;
+    const float * coefficients = phasors->coefficients;
+    const float * rotation = phasors->rotation;
+#ifdef PHASOR_SSE
+    __m128 acc[COEF_COUNT];
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 threeHalves = _mm_set1_ps(1.5f);
+    for(int b = begin; b < end; ++b)
+    {
+        for(int k = 0; k < COEF_COUNT; ++k)
+            acc[k] = _mm_setzero_ps();
+        float * s = phasors->state + (size_t)b * n * PHASOR_STRIDE;
+        for(int w = 0; w < n; ++w, s += PHASOR_STRIDE)
+        {
+            __m128 re = _mm_load_ps(s);
+            __m128 im = _mm_load_ps(s + PHASOR_BLOCK);
+            __m128 rr = _mm_set1_ps(rotation[w * 2]);
+            __m128 ri = _mm_set1_ps(rotation[w * 2 + 1]);
+            __m128 nr = _mm_sub_ps(_mm_mul_ps(re, rr), _mm_mul_ps(im, ri));
+            __m128 ni = _mm_add_ps(_mm_mul_ps(re, ri), _mm_mul_ps(im, rr));
+            if(update->renormalize)
+            {
+                // one Newton step towards |p| = 1
+                __m128 m = _mm_add_ps(_mm_mul_ps(nr, nr), _mm_mul_ps(ni, ni));
+                __m128 f = _mm_sub_ps(threeHalves, _mm_mul_ps(half, m));
+                nr = _mm_mul_ps(nr, f);
+                ni = _mm_mul_ps(ni, f);
+            }
+            _mm_store_ps(s, nr);
+            _mm_store_ps(s + PHASOR_BLOCK, ni);
+            const float * c = coefficients + w * COEF_COUNT;
+            acc[COEF_POS_X] = _mm_add_ps(acc[COEF_POS_X], _mm_mul_ps(_mm_set1_ps(c[COEF_POS_X]), nr));
+            acc[COEF_POS_Z] = _mm_add_ps(acc[COEF_POS_Z], _mm_mul_ps(_mm_set1_ps(c[COEF_POS_Z]), nr));
+            acc[COEF_POS_Y] = _mm_add_ps(acc[COEF_POS_Y], _mm_mul_ps(_mm_set1_ps(c[COEF_POS_Y]), ni));
+            acc[COEF_NORM_X] = _mm_add_ps(acc[COEF_NORM_X], _mm_mul_ps(_mm_set1_ps(c[COEF_NORM_X]), nr));
+            acc[COEF_NORM_Z] = _mm_add_ps(acc[COEF_NORM_Z], _mm_mul_ps(_mm_set1_ps(c[COEF_NORM_Z]), nr));
+            acc[COEF_NORM_Y] = _mm_add_ps(acc[COEF_NORM_Y], _mm_mul_ps(_mm_set1_ps(c[COEF_NORM_Y]), ni));
+        }
+        float sums[COEF_COUNT * PHASOR_BLOCK];
+        for(int k = 0; k < COEF_COUNT; ++k)
+            _mm_storeu_ps(sums + k * PHASOR_BLOCK, acc[k]);
+        StoreSums(phasors, b, sums, update->sums);
+    }
+#else
+    float acc[COEF_COUNT * PHASOR_BLOCK];
+    for(int b = begin; b < end; ++b)
+    {
+        memset(acc, 0, sizeof(acc));
+        float * s = phasors->state + (size_t)b * n * PHASOR_STRIDE;
+        for(int w = 0; w < n; ++w, s += PHASOR_STRIDE)
+        {
+            float rr = rotation[w * 2];
+            float ri = rotation[w * 2 + 1];
+            const float * c = coefficients + w * COEF_COUNT;
+            for(int l = 0; l < PHASOR_BLOCK; ++l)
+            {
+                float re = s[l];
+                float im = s[PHASOR_BLOCK + l];
+                float nr = re * rr - im * ri;
+                float ni = re * ri + im * rr;
+                if(update->renormalize)
+                {
+                    float f = 1.5f - 0.5f * (nr * nr + ni * ni);
+                    nr *= f;
+                    ni *= f;
+                }
+                s[l] = nr;
+                s[PHASOR_BLOCK + l] = ni;
+                for(int k = 0; k < COEF_COUNT; ++k)
+                    acc[k * PHASOR_BLOCK + l] += c[k] * (k == COEF_POS_Y || k == COEF_NORM_Y ? ni : nr);
+            }
+        }
+        StoreSums(phasors, b, acc, update->sums);
+    }
+#endif
+}
+
+void UpdateWavePhasors(WavePhasors * phasors, float time, WaveSum * sums)
+{
+    if(phasors->resyncInterval > 0 && phasors->frames >= phasors->resyncInterval)
+        ResyncWavePhasors(phasors, time);
+
+    // the rotation takes each wave from the phase it was left at to the
+    // exact target, so errors in the rotations themselves do not add up
+    double target = WAVE_PHASE * (double)time;
+    for(int w = 0; w < phasors->waveCount; ++w)
+    {
+        double step = target - phasors->phase[w];
+        phasors->rotation[w * 2] = (float)cos(step);
+        phasors->rotation[w * 2 + 1] = (float)sin(step);
+        phasors->phase[w] = target;
+    }
+
+    ++phasors->frames;
+    PhasorUpdate update;
+    update.phasors = phasors;
+    update.sums = sums;
+    update.renormalize = phasors->renormalizeInterval > 0
+                         && phasors->frames % phasors->renormalizeInterval == 0;
+    ParallelFor(phasors->blockCount, 0, UpdateBlocks, &update);
+}
@@ -0,0 +1,51 @@
+#ifndef REEF_PHASORS_H
+#define REEF_PHASORS_H
+
+#include "Waves.h"
+
+#include <stddef.h>
+
+// Incremental CPU evaluation of the Gerstner sum over a fixed set of vertices.
+// Between frames only the PHASE * time term of every wave's phase changes, so
+// each vertex keeps the complex phasor exp(i * phase) per wave and a frame
+// just rotates it by that wave's phase step: a complex multiply instead of a
+// sin and cos. Phasors are stored per block of PHASOR_BLOCK vertices, wave by
+// wave, for SIMD. Rounding makes the magnitude drift, which a cheap Newton
+// step fixes every renormalizeInterval frames. The phase error grows much
+// more slowly and is cleared by recomputing the phasors from scratch every
+// resyncInterval frames, which costs one direct evaluation per interval.
+
+#define PHASOR_BLOCK 4
+#define PHASOR_RENORMALIZE_INTERVAL 64
+#define PHASOR_RESYNC_INTERVAL 3600
+
+struct WavePhasors
+{
+    int waveCount;
+    int vertexCount;
+    int blockCount;
+    float * x;
+    float * z;
+    float * state;
+    float * coefficients;
+    float * rotation;
+    double * phase;
+    Wave * waves;
+    float crestFactor;
+    int renormalizeInterval;
+    int resyncInterval;
+    long frames;
+};
+
+bool CreateWavePhasors(WavePhasors * phasors, const Wave * waves, int waveCount,
+                       float crestFactor, const float * x, const float * z,
+                       int vertexCount, float time);
+void DestroyWavePhasors(WavePhasors * phasors);
+size_t WavePhasorBytes(const WavePhasors * phasors);
+
+// Rebuilds every phasor from its exact phase at the given time.
+void ResyncWavePhasors(WavePhasors * phasors, float time);
+// Advances the phasors to time and writes one WaveSum per vertex.
+void UpdateWavePhasors(WavePhasors * phasors, float time, WaveSum * sums);
+
+#endif
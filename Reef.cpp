@@ -18,6 +18,11 @@
 #include <d3dx11.h>
 #include <d3dcompiler.h>
 #include <xnamath.h>
+#include "FrameArena.h"
+#include "Jobs.h"
+#include "Wake.h"
+#include "WaterBodies.h"
+#include "Waves.h"
 
 #define SAFE_RELEASE(p) do{if(p) (p)->Release(); (p) = NULL;}while(0);
 #define V_HR(x, msg) do{hr = (x); if(FAILED(hr)) throw Exception(hr, msg);}while(0);
@@ -27,8 +32,38 @@
 #define AF 16
 #define SHADERS_FILENAME L"Reef.hlsl"
 #define CUBEMAP_FILENAME L"Reef.dds"
+#define WAVES_FILENAME "Reef.waves"
 #define MESH_PATCHES_X 50
 #define MESH_PATCHES_Z 50
+#define WAKE_PICK_RADIUS 0.03f
+#define WAKE_PICK_STRENGTH -0.004f
+#define WAKE_DRAG_STRENGTH -0.001f
+#define BAND_PIXELS_PER_WAVE 4
+#define FRAME_ARENA_SIZE (4 << 20)
+#define WATER_MAX_BODIES 1024
+#define WATER_MAX_BODY_WAVES 64
+#define WATER_MAX_WAVES (WATER_MAX_BODIES * 16)
+
+struct DrawItem
+{
+    XMMATRIX world;
+    ID3D11InputLayout * inputLayout;
+    ID3D11Buffer * vertexBuffer;
+    ID3D11Buffer * instanceBuffer;
+    ID3D11Buffer * indexBuffer;
+    UINT indexCount;
+    UINT instanceCount;
+    ID3D11VertexShader * vertexShader;
+    ID3D11PixelShader * pixelShader;
+};
+
+typedef std::vector<DrawItem, FrameAllocator<DrawItem> > DrawList;
+
+struct WaterPatches
+{
+    XMFLOAT3 * vertices;
+    DWORD * indices;
+};
 
 struct Exception
 {
@@ -45,43 +80,64 @@ struct VertexShaderConstantBuffer
 {
 	XMMATRIX worldViewProjection;
     XMMATRIX world;
+    XMFLOAT3 bandEye;
+    FLOAT bandScale;
+    FLOAT bandNyquist;
 	FLOAT time;
-    INT waveCount;
-    FLOAT crestFactor;
+};
+
+__declspec(align(16))
+struct WakeConstantBuffer
+{
+    XMFLOAT2 origin;
+    FLOAT cellSize;
+    FLOAT invExtent;
+    FLOAT meshSpacing;
 };
 
 __declspec(align(16))
 struct PixelShaderConstantBuffer
 {
     XMFLOAT3 eyePos;
-    FLOAT reflectivity;
+    FLOAT specularFactor;
     XMFLOAT3 lightDir;
-    FLOAT transmittance;
+    FLOAT shininess;
     XMFLOAT3 lightColor;
-    FLOAT fresnelPower;
-    XMFLOAT3 waterColor;
-    FLOAT fresnelScale;
+    // a float3 may not straddle a constant register
+    FLOAT padding;
     XMFLOAT3 etaRatio;
-    FLOAT fresnelBias;
-    FLOAT specularFactor;
-    FLOAT shininess;
 };
 
-struct Wave
-{
-    XMFLOAT2 dir;
-    FLOAT length;
-    FLOAT amp;
-};
+// HLSL starts a float3 on a new 16-byte register whenever it would straddle
+// one; these must stay in step with the cbuffers in Reef.hlsl
+static_assert(offsetof(VertexShaderConstantBuffer, bandEye) == 128, "bandEye must start register 8");
+static_assert(offsetof(VertexShaderConstantBuffer, bandScale) == 140, "bandScale must follow bandEye");
+static_assert(offsetof(VertexShaderConstantBuffer, bandNyquist) == 144, "bandNyquist must start register 9");
+static_assert(offsetof(VertexShaderConstantBuffer, time) == 148, "time must follow bandNyquist");
+static_assert(sizeof(VertexShaderConstantBuffer) == 160, "vertex shader constants must fill 10 registers");
+static_assert(offsetof(WakeConstantBuffer, meshSpacing) == 16, "meshSpacing must start register 1");
+static_assert(sizeof(WakeConstantBuffer) == 32, "wake constants must fill 2 registers");
+static_assert(offsetof(PixelShaderConstantBuffer, lightDir) == 16, "lightDir must start register 1");
+static_assert(offsetof(PixelShaderConstantBuffer, lightColor) == 32, "lightColor must start register 2");
+static_assert(offsetof(PixelShaderConstantBuffer, etaRatio) == 48, "etaRatio must start register 3");
+static_assert(sizeof(PixelShaderConstantBuffer) == 64, "pixel shader constants must fill 4 registers");
 
 void InitWindow();
 void InitDevice();
 void InitCamera();
 void InitShaders();
+void InitJobSystem();
+void InitFrameMemory();
 void InitGeometry();
+void BuildWaterPatches(void * context, INT begin, INT end);
 void InitResources();
+void InitWake();
+void InitWaterBodies();
 void Cleanup();
 void Render();
+void UpdateWake(FLOAT seconds);
+void UpdateWaveBuffer();
+BOOL PickWater(INT x, INT y, XMFLOAT3 * hit);
 void ResizeBuffers();
 INT64 GetCounter();
 INT64 GetFrequency();
@@ -94,6 +150,7 @@ IDXGISwapChain * swapChain = NULL;
 ID3D11RenderTargetView * backBufferRTV = NULL;
 ID3D11DepthStencilView * depthStencilView = NULL;
 ID3D11InputLayout * inputLayout = NULL;
+ID3D11InputLayout * waterInputLayout = NULL;
 ID3D11VertexShader * waterVS = NULL;
 ID3D11VertexShader * skyVS = NULL;
 ID3D11PixelShader * waterPS = NULL;
@@ -102,13 +159,18 @@ ID3D11Buffer * waterVB = NULL;
 ID3D11Buffer * skyVB = NULL;
 ID3D11Buffer * waterIB = NULL;
 ID3D11Buffer * skyIB = NULL;
+ID3D11Buffer * waterInstanceVB = NULL;
 ID3D11SamplerState * anisotropicSampler = NULL;
 ID3D11ShaderResourceView * cubeMapSRV = NULL;
+ID3D11Buffer * waveBuffer = NULL;
 ID3D11ShaderResourceView * waveBufferSRV = NULL;
 ID3D11Buffer * vsCB = NULL;
 ID3D11Buffer * psCB = NULL;
+ID3D11Buffer * wakeCB = NULL;
+ID3D11Texture2D * wakeTexture = NULL;
+ID3D11ShaderResourceView * wakeSRV = NULL;
+ID3D11SamplerState * wakeSampler = NULL;
 
-XMMATRIX waterWorld;
 INT64 counter;
 FLOAT time = 0.0f;
 FLOAT waveInterval = 5;
@@ -121,17 +183,27 @@ XMMATRIX view;
 XMMATRIX projection;
 
 BOOL paused = FALSE;
+BOOL dragging = FALSE;
+
+Wake wake = {0};
+FLOAT wakeTime = 0.0f;
+
+WaterBodies waterBodies = {0};
 
 INT WINAPI WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, INT cmdShow)
 {
     try
     {
+        InitJobSystem();
+        InitFrameMemory();
         InitWindow();
         InitDevice();
         InitCamera();
         InitShaders();
         InitGeometry();
         InitResources();
+        InitWake();
+        InitWaterBodies();
         counter = GetCounter();
         ShowWindow(window, SW_SHOWNORMAL);
         MSG msg = {0};
@@ -163,6 +235,8 @@ void Render()
 {
     if(!paused)
     {        
+        BeginFrameArena();
+
         FLOAT dt = (GetCounter() - counter)
                    / (FLOAT)GetFrequency()
                    / waveInterval;
@@ -171,6 +245,9 @@ void Render()
         time += dt;
         if(time > 1.0f)
             time = 0.0f;
+
+        UpdateWake(dt * waveInterval);
+        UpdateWaveBuffer();
         
         deviceContext->OMSetRenderTargets(1, &backBufferRTV, depthStencilView);
 
@@ -179,73 +256,123 @@ void Render()
         deviceContext->ClearDepthStencilView(depthStencilView, D3D11_CLEAR_DEPTH, 1.0f, 0);
 
         deviceContext->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-        deviceContext->IASetInputLayout(inputLayout);
 
         deviceContext->RSSetViewports(1, &viewport);
 
         deviceContext->VSSetConstantBuffers(0, 1, &vsCB);
         deviceContext->VSSetShaderResources(0, 1, &waveBufferSRV);
+        deviceContext->VSSetShaderResources(1, 1, &wakeSRV);
+        deviceContext->VSSetSamplers(1, 1, &wakeSampler);
 
         deviceContext->PSSetConstantBuffers(0, 1, &psCB);
         deviceContext->PSSetShaderResources(0, 1, &cubeMapSRV);
         deviceContext->PSSetSamplers(0, 1, &anisotropicSampler);
 
-        UINT stride = sizeof(XMFLOAT3);
-        UINT offset = 0;
+        // the vertex shader displaces by the wake, the pixel shader bends
+        // normals by its full resolution slope
+        WakeConstantBuffer wakeBuffer;
+        wakeBuffer.origin = XMFLOAT2(WakeOriginX(&wake) - 0.5f * WAKE_CELL_SIZE,
+                                     WakeOriginZ(&wake) - 0.5f * WAKE_CELL_SIZE);
+        wakeBuffer.cellSize = WAKE_CELL_SIZE;
+        wakeBuffer.invExtent = 1.0f / (WAKE_CELLS * WAKE_CELL_SIZE);
+        wakeBuffer.meshSpacing = 2.0f / min(MESH_PATCHES_X, MESH_PATCHES_Z);
+        deviceContext->UpdateSubresource(wakeCB, 0, NULL, &wakeBuffer, 0, 0);
+        deviceContext->VSSetConstantBuffers(1, 1, &wakeCB);
+        deviceContext->PSSetConstantBuffers(1, 1, &wakeCB);
+        deviceContext->PSSetShaderResources(1, 1, &wakeSRV);
+        deviceContext->PSSetSamplers(1, 1, &wakeSampler);
+
+        UINT strides[2] = { sizeof(XMFLOAT3), sizeof(WaterInstance) };
+        UINT offsets[2] = { 0, 0 };
 
         VertexShaderConstantBuffer vsBuffer;
         vsBuffer.time = time;
-        vsBuffer.crestFactor = 0.8f;
-        D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc;
-        waveBufferSRV->GetDesc(&srvDesc);
-        vsBuffer.waveCount = srvDesc.Buffer.NumElements;
+        vsBuffer.bandEye = eyePos;
+        vsBuffer.bandScale = BAND_PIXELS_PER_WAVE * 2 * tanf(XM_PIDIV4 / 2) / viewport.Height;
+        vsBuffer.bandNyquist = 2 * 2.0f / min(MESH_PATCHES_X, MESH_PATCHES_Z);
 
         PixelShaderConstantBuffer psBuffer;       
         psBuffer.eyePos = eyePos;
         psBuffer.lightColor = XMFLOAT3(1, 1, 0.8f);
         psBuffer.lightDir = XMFLOAT3(1, 1, 1);
-        psBuffer.waterColor = XMFLOAT3(0, 0.5f, 1);
         psBuffer.etaRatio = XMFLOAT3(0.85f, 0.85f, 0.85f);
-        psBuffer.reflectivity = 0.9f;
-        psBuffer.transmittance = 0.9f;
-        psBuffer.fresnelPower = 1;
-        psBuffer.fresnelScale = 0.9f;
-        psBuffer.fresnelBias = 0;
         psBuffer.specularFactor = 1;
         psBuffer.shininess = 100;
-
-        // draw skybox
-        
-        deviceContext->IASetVertexBuffers(0, 1, &skyVB, &stride, &offset);
-        deviceContext->IASetIndexBuffer(skyIB, DXGI_FORMAT_R32_UINT, 0);
-
-        vsBuffer.world = XMMatrixScaling(50, 50, 50);
-        vsBuffer.worldViewProjection = vsBuffer.world * view * projection;
-        
-        deviceContext->UpdateSubresource(vsCB, 0, NULL, &vsBuffer, 0, 0);
-        deviceContext->VSSetShader(skyVS, NULL, 0);
+        psBuffer.padding = 0;
+
+        DrawList draws;
+        draws.reserve(2);
+        DrawItem item;
+
+        // skybox
+
+        item.world = XMMatrixScaling(50, 50, 50);
+        item.inputLayout = inputLayout;
+        item.vertexBuffer = skyVB;
+        item.instanceBuffer = NULL;
+        item.indexBuffer = skyIB;
+        item.indexCount = 36;
+        item.instanceCount = 1;
+        item.vertexShader = skyVS;
+        item.pixelShader = skyPS;
+        draws.push_back(item);
+
+        // water, every visible body in one instanced draw
+
+        XMFLOAT4X4 viewProjection;
+        XMStoreFloat4x4(&viewProjection, view * projection);
+        WaterFrustum frustum;
+        ExtractWaterFrustum(viewProjection.m, &frustum);
+        WaterInstance * instances;
+        INT visible = CullWaterBodies(&waterBodies, frustum, &instances);
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        if(visible && SUCCEEDED(deviceContext->Map(waterInstanceVB, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+        {
+            memcpy(mapped.pData, instances, visible * sizeof(WaterInstance));
+            deviceContext->Unmap(waterInstanceVB, 0);
+
+            D3D11_BUFFER_DESC bd;
+            waterIB->GetDesc(&bd);
+            item.world = XMMatrixIdentity();
+            item.inputLayout = waterInputLayout;
+            item.vertexBuffer = waterVB;
+            item.instanceBuffer = waterInstanceVB;
+            item.indexBuffer = waterIB;
+            item.indexCount = bd.ByteWidth / sizeof(DWORD);
+            item.instanceCount = visible;
+            item.vertexShader = waterVS;
+            item.pixelShader = waterPS;
+            draws.push_back(item);
+        }
 
         deviceContext->UpdateSubresource(psCB, 0, NULL, &psBuffer, 0, 0);
-        deviceContext->PSSetShader(skyPS, NULL, 0);
-
-        deviceContext->DrawIndexed(36, 0, 0);
-
-        // draw water
 
-        deviceContext->IASetVertexBuffers(0, 1, &waterVB, &stride, &offset);
-        deviceContext->IASetIndexBuffer(waterIB, DXGI_FORMAT_R32_UINT, 0);
+        for(DrawList::const_iterator i = draws.begin(); i != draws.end(); ++i)
+        {
+            ID3D11Buffer * buffers[2] = { i->vertexBuffer, i->instanceBuffer };
+            deviceContext->IASetInputLayout(i->inputLayout);
+            deviceContext->IASetVertexBuffers(0, i->instanceBuffer ? 2 : 1, buffers, strides, offsets);
+            deviceContext->IASetIndexBuffer(i->indexBuffer, DXGI_FORMAT_R32_UINT, 0);
 
-        vsBuffer.world = waterWorld;
-        vsBuffer.worldViewProjection = vsBuffer.world * view * projection;
+            vsBuffer.world = i->world;
+            vsBuffer.worldViewProjection = vsBuffer.world * view * projection;
 
-        deviceContext->UpdateSubresource(vsCB, 0, NULL, &vsBuffer, 0, 0);
-        deviceContext->VSSetShader(waterVS, NULL, 0);
+            deviceContext->UpdateSubresource(vsCB, 0, NULL, &vsBuffer, 0, 0);
+            deviceContext->VSSetShader(i->vertexShader, NULL, 0);
+            deviceContext->PSSetShader(i->pixelShader, NULL, 0);
 
-        deviceContext->PSSetShader(waterPS, NULL, 0);
+            if(i->instanceBuffer)
+                deviceContext->DrawIndexedInstanced(i->indexCount, i->instanceCount, 0, 0, 0);
+            else
+                deviceContext->DrawIndexed(i->indexCount, 0, 0);
+        }
 
-        D3D11_BUFFER_DESC bd;
-        waterIB->GetDesc(&bd);
-        deviceContext->DrawIndexed(bd.ByteWidth / sizeof(DWORD), 0, 0);
+#if defined(DEBUG) || defined(_DEBUG)
+        FrameArenaStats arenaStats;
+        GetFrameArenaStats(&arenaStats);
+        if(arenaStats.frame > FRAME_ARENA_COUNT && arenaStats.fallbackCount)
+            OutputDebugStringA("Frame arena overflowed, transient allocations fell back to the heap.\n");
+#endif
 
     }
     // present scene
@@ -433,20 +560,37 @@ void InitShaders()
                     NULL,
                     &waterVS),
          "Unable to create water vertex shader from compiled bytecode.");
-    D3D11_INPUT_ELEMENT_DESC layoutDesc[1];
-    layoutDesc[0].SemanticName = "POSITION";
-    layoutDesc[0].SemanticIndex = 0;
-    layoutDesc[0].Format = DXGI_FORMAT_R32G32B32_FLOAT;
-    layoutDesc[0].InputSlot = 0;
-    layoutDesc[0].AlignedByteOffset = 0;    
-    layoutDesc[0].InputSlotClass = D3D11_INPUT_PER_VERTEX_DATA;
-    layoutDesc[0].InstanceDataStepRate = 0;
+    // slot 0 is the shared mesh, slot 1 one WaterInstance per body
+    D3D11_INPUT_ELEMENT_DESC waterLayoutDesc[] =
+    {
+        { "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+        { "WORLD", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, offsetof(WaterInstance, transform),
+          D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        { "WORLD", 1, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, offsetof(WaterInstance, transform) + 16,
+          D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        { "WORLD", 2, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, offsetof(WaterInstance, transform) + 32,
+          D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        { "WORLDNORMAL", 0, DXGI_FORMAT_R32G32B32_FLOAT, 1, offsetof(WaterInstance, normalTransform),
+          D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        { "WORLDNORMAL", 1, DXGI_FORMAT_R32G32B32_FLOAT, 1, offsetof(WaterInstance, normalTransform) + 12,
+          D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        { "WORLDNORMAL", 2, DXGI_FORMAT_R32G32B32_FLOAT, 1, offsetof(WaterInstance, normalTransform) + 24,
+          D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        { "WAVES", 0, DXGI_FORMAT_R32G32_UINT, 1, offsetof(WaterInstance, waveOffset),
+          D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        { "PARAMS", 0, DXGI_FORMAT_R32G32_FLOAT, 1, offsetof(WaterInstance, crestFactor),
+          D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        { "MATERIAL", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, offsetof(WaterInstance, material),
+          D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        { "MATERIAL", 1, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, offsetof(WaterInstance, material) + 16,
+          D3D11_INPUT_PER_INSTANCE_DATA, 1 }
+    };
     V_HR(device->CreateInputLayout(
-                    layoutDesc,
-                    ARRAYSIZE(layoutDesc),
+                    waterLayoutDesc,
+                    ARRAYSIZE(waterLayoutDesc),
                     blob->GetBufferPointer(),
                     blob->GetBufferSize(),
-                    &inputLayout),
+                    &waterInputLayout),
          "Unable to create input layout from water shader bytecode.");
     SAFE_RELEASE(blob);
     SAFE_RELEASE(errors);
@@ -471,6 +615,21 @@ void InitShaders()
                     NULL,
                     &skyVS),
          "Unable to create skybox vertex shader from compiled bytecode.");
+    D3D11_INPUT_ELEMENT_DESC layoutDesc[1];
+    layoutDesc[0].SemanticName = "POSITION";
+    layoutDesc[0].SemanticIndex = 0;
+    layoutDesc[0].Format = DXGI_FORMAT_R32G32B32_FLOAT;
+    layoutDesc[0].InputSlot = 0;
+    layoutDesc[0].AlignedByteOffset = 0;    
+    layoutDesc[0].InputSlotClass = D3D11_INPUT_PER_VERTEX_DATA;
+    layoutDesc[0].InstanceDataStepRate = 0;
+    V_HR(device->CreateInputLayout(
+                    layoutDesc,
+                    ARRAYSIZE(layoutDesc),
+                    blob->GetBufferPointer(),
+                    blob->GetBufferSize(),
+                    &inputLayout),
+         "Unable to create input layout from skybox shader bytecode.");
     SAFE_RELEASE(blob);
     SAFE_RELEASE(errors);
 
@@ -535,34 +694,11 @@ void InitGeometry()
     sd.SysMemPitch = 0;
     sd.SysMemSlicePitch = 0;
 
-    std::vector<XMFLOAT3> vertices;
-    std::vector<DWORD> indices;
-
-    for(int i = 0; i < MESH_PATCHES_X; ++i)
-    {
-        for(int j = 0; j < MESH_PATCHES_Z; ++j)
-        {
-            vertices.push_back(XMFLOAT3( (2.0f / MESH_PATCHES_X) * (i + 0) - 1.0f,
-								         0.0f,
-								         (2.0f / MESH_PATCHES_Z) * (j + 0) - 1.0f ));
-            vertices.push_back(XMFLOAT3( (2.0f / MESH_PATCHES_X) * (i + 0) - 1.0f,
-								         0.0f,
-								         (2.0f / MESH_PATCHES_Z) * (j + 1) - 1.0f ));
-            vertices.push_back(XMFLOAT3( (2.0f / MESH_PATCHES_X) * (i + 1) - 1.0f,
-								         0.0f,
-								         (2.0f / MESH_PATCHES_Z) * (j + 1) - 1.0f ));
-            vertices.push_back(XMFLOAT3( (2.0f / MESH_PATCHES_X) * (i + 1) - 1.0f,
-								         0.0f,
-								         (2.0f / MESH_PATCHES_Z) * (j + 0) - 1.0f ));
-
-            indices.push_back((i*MESH_PATCHES_Z + j)*4 + 0);
-            indices.push_back((i*MESH_PATCHES_Z + j)*4 + 1);
-            indices.push_back((i*MESH_PATCHES_Z + j)*4 + 2);
-            indices.push_back((i*MESH_PATCHES_Z + j)*4 + 2);
-            indices.push_back((i*MESH_PATCHES_Z + j)*4 + 3);
-            indices.push_back((i*MESH_PATCHES_Z + j)*4 + 0);
-        }
-    }
+    // runs before the first frame, so the frame arenas are not available yet
+    std::vector<XMFLOAT3> vertices(MESH_PATCHES_X * MESH_PATCHES_Z * 4);
+    std::vector<DWORD> indices(MESH_PATCHES_X * MESH_PATCHES_Z * 6);
+    WaterPatches patches = { vertices.data(), indices.data() };
+    ParallelFor(MESH_PATCHES_X, 0, BuildWaterPatches, &patches);
 
     bd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
     bd.ByteWidth = vertices.size() * sizeof(XMFLOAT3);
@@ -636,8 +772,38 @@ void InitGeometry()
     sd.pSysMem = indices.data();
     V_HR(device->CreateBuffer(&bd, &sd, &skyIB),
          "Unable to create skybox index buffer.");
+}
 
-    waterWorld = XMMatrixIdentity();
+void BuildWaterPatches(void * context, INT begin, INT end)
+{
+    WaterPatches * patches = (WaterPatches*)context;
+    XMFLOAT3 * vertex = patches->vertices + begin * MESH_PATCHES_Z * 4;
+    DWORD * index = patches->indices + begin * MESH_PATCHES_Z * 6;
+    for(INT i = begin; i < end; ++i)
+    {
+        for(int j = 0; j < MESH_PATCHES_Z; ++j)
+        {
+            *vertex++ = XMFLOAT3( (2.0f / MESH_PATCHES_X) * (i + 0) - 1.0f,
+                                  0.0f,
+                                  (2.0f / MESH_PATCHES_Z) * (j + 0) - 1.0f );
+            *vertex++ = XMFLOAT3( (2.0f / MESH_PATCHES_X) * (i + 0) - 1.0f,
+                                  0.0f,
+                                  (2.0f / MESH_PATCHES_Z) * (j + 1) - 1.0f );
+            *vertex++ = XMFLOAT3( (2.0f / MESH_PATCHES_X) * (i + 1) - 1.0f,
+                                  0.0f,
+                                  (2.0f / MESH_PATCHES_Z) * (j + 1) - 1.0f );
+            *vertex++ = XMFLOAT3( (2.0f / MESH_PATCHES_X) * (i + 1) - 1.0f,
+                                  0.0f,
+                                  (2.0f / MESH_PATCHES_Z) * (j + 0) - 1.0f );
+
+            *index++ = (i*MESH_PATCHES_Z + j)*4 + 0;
+            *index++ = (i*MESH_PATCHES_Z + j)*4 + 1;
+            *index++ = (i*MESH_PATCHES_Z + j)*4 + 2;
+            *index++ = (i*MESH_PATCHES_Z + j)*4 + 2;
+            *index++ = (i*MESH_PATCHES_Z + j)*4 + 3;
+            *index++ = (i*MESH_PATCHES_Z + j)*4 + 0;
+        }
+    }
 }
 
 void InitResources()
@@ -671,27 +837,149 @@ void InitResources()
             NULL),
          "Unable to load skybox texture.");
 
-    Wave waves[] = 
+    D3D11_BUFFER_DESC bd;
+    bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    bd.StructureByteStride = 0;
+    bd.CPUAccessFlags = 0;
+    bd.MiscFlags = 0;
+    bd.Usage = D3D11_USAGE_DEFAULT;
+
+    bd.ByteWidth = sizeof(VertexShaderConstantBuffer);
+    V_HR(device->CreateBuffer(&bd, NULL, &vsCB),
+         "Unable to create constant buffer for vertex shaders.");
+
+    bd.ByteWidth = sizeof(PixelShaderConstantBuffer);
+    V_HR(device->CreateBuffer(&bd, NULL, &psCB),
+         "Unable to create constant buffer for pixel shaders.");
+}
+
+void InitJobSystem()
+{
+    if(!InitJobs())
+        throw Exception(E_FAIL, "Unable to start job system worker threads.");
+}
+
+void InitFrameMemory()
+{
+    if(!InitFrameArenas(FRAME_ARENA_SIZE))
+        throw Exception(E_OUTOFMEMORY, "Unable to allocate frame arenas.");
+}
+
+void InitWake()
+{
+    HRESULT hr;
+
+    WakeParams params;
+    params.cells = WAKE_CELLS;
+    params.cellSize = WAKE_CELL_SIZE;
+    params.speed = WAKE_SPEED;
+    params.damping = WAKE_DAMPING;
+    params.spongeCells = WAKE_SPONGE;
+    if(!CreateWake(&wake, params, WAKE_TIMESTEP))
+        throw Exception(E_INVALIDARG,
+                        "Unable to create wake solver: grid is invalid or unstable at this timestep.");
+    CenterWake(&wake, eyePos.x, eyePos.z);
+
+    // full mip chain, so vertices can take the wake low-passed to the mesh
+    // spacing; level 0 is uploaded and the rest generated every step
+    D3D11_TEXTURE2D_DESC td;
+    td.Width = WAKE_CELLS;
+    td.Height = WAKE_CELLS;
+    td.MipLevels = 0;
+    td.ArraySize = 1;
+    td.Format = DXGI_FORMAT_R32_FLOAT;
+    td.SampleDesc.Count = 1;
+    td.SampleDesc.Quality = 0;
+    td.Usage = D3D11_USAGE_DEFAULT;
+    td.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+    td.CPUAccessFlags = 0;
+    td.MiscFlags = D3D11_RESOURCE_MISC_GENERATE_MIPS;
+
+    V_HR(device->CreateTexture2D(&td, NULL, &wakeTexture),
+         "Unable to create wake height texture.");
+    V_HR(device->CreateShaderResourceView(wakeTexture, NULL, &wakeSRV),
+         "Unable to create shader resource view for wake height texture.");
+
+    std::vector<FLOAT> zeros(WAKE_CELLS * WAKE_CELLS, 0.0f);
+    deviceContext->UpdateSubresource(wakeTexture, 0, NULL, zeros.data(), WAKE_CELLS * sizeof(FLOAT), 0);
+    deviceContext->GenerateMips(wakeSRV);
+
+    D3D11_BUFFER_DESC bd;
+    bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    bd.ByteWidth = sizeof(WakeConstantBuffer);
+    bd.StructureByteStride = 0;
+    bd.CPUAccessFlags = 0;
+    bd.MiscFlags = 0;
+    bd.Usage = D3D11_USAGE_DEFAULT;
+    V_HR(device->CreateBuffer(&bd, NULL, &wakeCB),
+         "Unable to create constant buffer for the wake.");
+
+    D3D11_SAMPLER_DESC samDesc;
+    samDesc.AddressU = samDesc.AddressV
+                     = samDesc.AddressW
+                     = D3D11_TEXTURE_ADDRESS_CLAMP;
+    samDesc.BorderColor[0] = samDesc.BorderColor[1]
+                           = samDesc.BorderColor[2]
+                           = samDesc.BorderColor[3]
+                           = 0;
+    samDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+    samDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+    samDesc.MaxAnisotropy = 1;
+    samDesc.MinLOD = 0;
+    samDesc.MaxLOD = D3D11_FLOAT32_MAX;
+    samDesc.MipLODBias = 0;
+
+    V_HR(device->CreateSamplerState(&samDesc, &wakeSampler),
+         "Unable to create wake sampler state.");
+}
+
+void InitWaterBodies()
+{
+    HRESULT hr;
+
+    if(!CreateWaterBodies(&waterBodies, WATER_MAX_BODIES, WATER_MAX_WAVES))
+        throw Exception(E_OUTOFMEMORY, "Unable to allocate water bodies.");
+
+    Wave defaultWaves[] = 
     {
-        { XMFLOAT2(-0.70710677f,  0.70710677f), 2, 0.01f },
-        { XMFLOAT2(-1, 0), 0.8f, 0.0035f }
+        { { -0.70710677f,  0.70710677f }, 2, 0.01f },
+        { { -1, 0 }, 0.8f, 0.0035f }
     };
 
+    // waves fitted by Tools/ReefFit, if present
+    Wave waves[WATER_MAX_BODY_WAVES];
+    INT waveCount = LoadWaves(WAVES_FILENAME, waves, ARRAYSIZE(waves));
+    if(waveCount <= 0)
+    {
+        waveCount = ARRAYSIZE(defaultWaves);
+        memcpy(waves, defaultWaves, sizeof(defaultWaves));
+    }
+
+    WaterBodyDesc desc;
+    desc.waves = waves;
+    desc.waveCount = waveCount;
+    desc.crestFactor = 0.8f;
+    desc.meshRadius = 1.41421356f;
+    // instances store the transposed world matrix, one row per coordinate
+    XMFLOAT4X4 transform;
+    XMStoreFloat4x4(&transform, XMMatrixTranspose(XMMatrixIdentity()));
+    memcpy(desc.transform, transform.m, sizeof(desc.transform));
+    WaterMaterial material = { { 0, 0.5f, 1 }, 0.9f, 0.9f, 0.9f, 0, 1 };
+    desc.material = material;
+    if(AddWaterBody(&waterBodies, desc) < 0)
+        throw Exception(E_OUTOFMEMORY, "Unable to add water body.");
+
+    // sized for every wave the bodies can hold, so bodies added later only
+    // need their waves uploaded, see UpdateWaveBuffer
     D3D11_BUFFER_DESC bd;
     bd.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-    bd.ByteWidth = sizeof(waves);
+    bd.ByteWidth = waterBodies.waveCapacity * sizeof(Wave);
     bd.StructureByteStride = 0;
     bd.CPUAccessFlags = 0;
     bd.MiscFlags = 0;
     bd.Usage = D3D11_USAGE_DEFAULT;
 
-    D3D11_SUBRESOURCE_DATA sd;
-    sd.SysMemPitch = 0;
-    sd.SysMemSlicePitch = 0;
-    sd.pSysMem = waves;
-
-    ID3D11Buffer * waveBuffer = NULL;
-    V_HR(device->CreateBuffer(&bd, &sd, &waveBuffer),
+    V_HR(device->CreateBuffer(&bd, NULL, &waveBuffer),
          "Unable to create buffer holding wave parameters.");
     
     D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc;
@@ -700,21 +988,77 @@ void InitResources()
     srvDesc.Buffer.ElementOffset = 0;
     srvDesc.Buffer.ElementWidth = sizeof(Wave);
     srvDesc.Buffer.FirstElement = 0;
-    srvDesc.Buffer.NumElements = ARRAYSIZE(waves);
+    srvDesc.Buffer.NumElements = waterBodies.waveCapacity;
 
-    hr = device->CreateShaderResourceView(waveBuffer, &srvDesc, &waveBufferSRV);
-    SAFE_RELEASE(waveBuffer);
-    V_HR(hr, "Unable to create shader resource view for wave buffer.");
+    V_HR(device->CreateShaderResourceView(waveBuffer, &srvDesc, &waveBufferSRV),
+         "Unable to create shader resource view for wave buffer.");
+    UpdateWaveBuffer();
 
-    bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    bd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+    bd.ByteWidth = WATER_MAX_BODIES * sizeof(WaterInstance);
+    bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    bd.Usage = D3D11_USAGE_DYNAMIC;
+    V_HR(device->CreateBuffer(&bd, NULL, &waterInstanceVB),
+         "Unable to create water instance buffer.");
+}
 
-    bd.ByteWidth = sizeof(VertexShaderConstantBuffer);
-    V_HR(device->CreateBuffer(&bd, NULL, &vsCB),
-         "Unable to create constant buffer for vertex shaders.");
+// copies the waves of bodies added since the last call to the wave buffer
+void UpdateWaveBuffer()
+{
+    INT first = waterBodies.uploadedWaveCount;
+    INT last = waterBodies.waveCount;
+    if(first == last)
+        return;
+    D3D11_BOX box = { (UINT)(first * sizeof(Wave)), 0, 0, (UINT)(last * sizeof(Wave)), 1, 1 };
+    deviceContext->UpdateSubresource(waveBuffer, 0, &box, waterBodies.waves + first, 0, 0);
+    waterBodies.uploadedWaveCount = last;
+}
 
-    bd.ByteWidth = sizeof(PixelShaderConstantBuffer);
-    V_HR(device->CreateBuffer(&bd, NULL, &psCB),
-         "Unable to create constant buffer for pixel shaders.");
+void UpdateWake(FLOAT seconds)
+{
+    CenterWake(&wake, eyePos.x, eyePos.z);
+
+    wakeTime += seconds;
+    INT steps = 0;
+    while(wakeTime >= WAKE_TIMESTEP && steps < WAKE_MAX_SUBSTEPS)
+    {
+        StepWake(&wake);
+        wakeTime -= WAKE_TIMESTEP;
+        ++steps;
+    }
+    // drop the time we can not catch up on instead of spiralling
+    if(wakeTime >= WAKE_TIMESTEP)
+        wakeTime = 0.0f;
+    if(!steps)
+        return;
+
+    deviceContext->UpdateSubresource(wakeTexture, 0, NULL, wake.height, WAKE_CELLS * sizeof(FLOAT), 0);
+    deviceContext->GenerateMips(wakeSRV);
+}
+
+BOOL PickWater(INT x, INT y, XMFLOAT3 * hit)
+{
+    XMVECTOR nearPoint = XMVector3Unproject(
+                            XMVectorSet((FLOAT)x, (FLOAT)y, 0, 0),
+                            viewport.TopLeftX, viewport.TopLeftY,
+                            viewport.Width, viewport.Height,
+                            viewport.MinDepth, viewport.MaxDepth,
+                            projection, view, XMMatrixIdentity());
+    XMVECTOR farPoint = XMVector3Unproject(
+                            XMVectorSet((FLOAT)x, (FLOAT)y, 1, 0),
+                            viewport.TopLeftX, viewport.TopLeftY,
+                            viewport.Width, viewport.Height,
+                            viewport.MinDepth, viewport.MaxDepth,
+                            projection, view, XMMatrixIdentity());
+    XMVECTOR dir = XMVectorSubtract(farPoint, nearPoint);
+    FLOAT dy = XMVectorGetY(dir);
+    if(dy > -1e-6f && dy < 1e-6f)
+        return FALSE;
+    FLOAT t = -XMVectorGetY(nearPoint) / dy;
+    if(t < 0 || t > 1)
+        return FALSE;
+    XMStoreFloat3(hit, XMVectorMultiplyAdd(dir, XMVectorReplicate(t), nearPoint));
+    return TRUE;
 }
 
 void Cleanup()
@@ -722,10 +1066,18 @@ void Cleanup()
     if(deviceContext)
         deviceContext->ClearState();
     
+    DestroyWake(&wake);
+    DestroyWaterBodies(&waterBodies);
+    SAFE_RELEASE(waterInstanceVB);
+    SAFE_RELEASE(wakeSampler);
+    SAFE_RELEASE(wakeSRV);
+    SAFE_RELEASE(wakeTexture);
+    SAFE_RELEASE(wakeCB);
     SAFE_RELEASE(vsCB);
     SAFE_RELEASE(psCB);
     SAFE_RELEASE(anisotropicSampler);
     SAFE_RELEASE(waveBufferSRV);
+    SAFE_RELEASE(waveBuffer);
     SAFE_RELEASE(cubeMapSRV);
     SAFE_RELEASE(waterVB);
     SAFE_RELEASE(skyVB);
@@ -736,11 +1088,14 @@ void Cleanup()
     SAFE_RELEASE(waterPS);
     SAFE_RELEASE(skyPS);
     SAFE_RELEASE(inputLayout);
+    SAFE_RELEASE(waterInputLayout);
     SAFE_RELEASE(depthStencilView);
     SAFE_RELEASE(backBufferRTV);
     SAFE_RELEASE(swapChain);
     SAFE_RELEASE(deviceContext);
     SAFE_RELEASE(device);
+    ShutdownJobs();
+    ShutdownFrameArenas();
 }
 
 void InitWindow()
@@ -811,6 +1166,32 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
             }
             return 0;
 
+        case WM_LBUTTONDOWN:
+            {
+                XMFLOAT3 hit;
+                dragging = TRUE;
+                SetCapture(hwnd);
+                if(wake.height && PickWater((SHORT)LOWORD(lParam), (SHORT)HIWORD(lParam), &hit))
+                    DisturbWake(&wake, hit.x, hit.z, WAKE_PICK_RADIUS, WAKE_PICK_STRENGTH);
+            }
+            return 0;
+
+        case WM_MOUSEMOVE:
+            {
+                XMFLOAT3 hit;
+                if(dragging && wake.height
+                   && PickWater((SHORT)LOWORD(lParam), (SHORT)HIWORD(lParam), &hit))
+                    DisturbWake(&wake, hit.x, hit.z, WAKE_PICK_RADIUS, WAKE_DRAG_STRENGTH);
+            }
+            return 0;
+
+        case WM_LBUTTONUP:
+            {
+                dragging = FALSE;
+                ReleaseCapture();
+            }
+            return 0;
+
         case WM_PAINT:
             {
                 Render();
@@ -6,25 +6,29 @@ cbuffer VertexShaderConstantBuffer : register(b0)
 {
 	float4x4 worldViewProjection;
     float4x4 world;
+    float3 bandEye;
+    float bandScale;
+    float bandNyquist;
 	float time;
-    int waveCount;
-    FLOAT crestFactor;
+};
+
+// bound to both WaterVS and WaterPS
+cbuffer WakeConstantBuffer : register(b1)
+{
+    float2 wakeOrigin;
+    float wakeCellSize;
+    float wakeInvExtent;
+    float wakeMeshSpacing;
 };
 
 cbuffer PixelShaderConstantBuffer : register(b0)
 {
     float3 eyePos;
-    float reflectivity;
+    float specularFactor;
     float3 lightDir;
-    float transmittance;
+    float shininess;
     float3 lightColor;
-    float fresnelPower;
-    float3 waterColor;
-    float fresnelScale;
     float3 etaRatio;
-    float fresnelBias;
-    float specularFactor;
-    float shininess;
 };
 
 TextureCube cubeMap : register(t0);
@@ -36,6 +40,26 @@ struct PS_INPUT
 	float4 pos : SV_Position;    
     float3 vPos : Texcoord0;
 	float3 norm : Texcoord1;
+    nointerpolation float4 color : Texcoord2;
+    nointerpolation float4 fresnel : Texcoord3;
+};
+
+// per-instance data of a water body: rows of its local to world transform
+// and of the inverse transpose for normals, its range in the shared wave
+// buffer, crest factor and largest axis scale, water color and reflectivity,
+// then transmittance and the fresnel terms
+struct WATER_INSTANCE
+{
+    float4 world0 : WORLD0;
+    float4 world1 : WORLD1;
+    float4 world2 : WORLD2;
+    float3 normal0 : WORLDNORMAL0;
+    float3 normal1 : WORLDNORMAL1;
+    float3 normal2 : WORLDNORMAL2;
+    uint2 waves : WAVES;
+    float2 params : PARAMS;
+    float4 color : MATERIAL0;
+    float4 fresnel : MATERIAL1;
 };
 
 struct WAVE
@@ -47,30 +71,43 @@ struct WAVE
 
 Buffer<WAVE> waveBuffer : register(t0);
 
+Texture2D<float> wakeMap : register(t1);
+
+SamplerState wakeSampler : register(s1);
+
 struct WAVE_SUM
 {
     float3 pos;
     float3 norm;
 };
 
-WAVE_SUM GerstnerWaveSum(float2 pos, Buffer<WAVE> waves, int n)
+// waves must be sorted longest first: the loop stops at the first wave
+// shorter than cutoff and fades out the ones below twice the cutoff
+WAVE_SUM GerstnerWaveSum(float2 pos, Buffer<WAVE> waves, uint offset, uint n,
+                         float crestFactor, float cutoff)
 {
     WAVE_SUM sum;
-    for(int i = 0; i < n; ++i)
+    sum.pos = 0;
+    sum.norm = 0;
+    for(uint i = 0; i < n; ++i)
     {
-        WAVE wave = waves[i];
+        WAVE wave = waves[offset + i];
+        if(wave.length <= cutoff)
+            break;
+        float fade = saturate(wave.length / cutoff - 1);
         float freq = sqrt(G * 2 * PI / wave.length);
         float q = 1/(wave.amp * freq * n) * crestFactor;        
-        float tmp = q * wave.amp * cos(dot(freq * wave.dir, pos) + PHASE * time);
+        float amp = wave.amp * fade;
+        float tmp = q * amp * cos(dot(freq * wave.dir, pos) + PHASE * time);
         sum.pos += float3( tmp * wave.dir.x,
-                           wave.amp * sin(dot(freq * wave.dir, pos) + PHASE * time),
+                           amp * sin(dot(freq * wave.dir, pos) + PHASE * time),
                            tmp * wave.dir.y );
         tmp = freq * dot(wave.dir, pos) + PHASE * time;
         float s = sin(tmp);
         float c = cos(tmp);
-        sum.norm += float3(wave.dir.x * freq * wave.amp * c,
-                           q * freq * wave.amp * s,
-                           wave.dir.y * freq * wave.amp * c);
+        sum.norm += float3(wave.dir.x * freq * amp * c,
+                           q * freq * amp * s,
+                           wave.dir.y * freq * amp * c);
     }
     sum.pos.x += pos.x;
     sum.pos.z += pos.y;
@@ -81,12 +118,54 @@ WAVE_SUM GerstnerWaveSum(float2 pos, Buffer<WAVE> waves, int n)
     return sum;
 }
 
-void WaterVS(float3 pos : POSITION, out PS_INPUT result)
+// Wake height at world position p for displacing vertices spaced spacing
+// apart: the mip whose texels span two vertices, so ripples finer than the
+// mesh can not alias into vertex noise.
+float WakeHeight(float2 p, float spacing)
 {
-    WAVE_SUM waveSum = GerstnerWaveSum(pos.xz, waveBuffer, waveCount);
-	result.pos = mul(worldViewProjection, float4(waveSum.pos, 1));
-    result.norm = mul(world, float4(waveSum.norm, 1)).xyz;
-    result.vPos = mul(world, float4(waveSum.pos, 1)).xyz;
+    float2 uv = (p - wakeOrigin) * wakeInvExtent;
+    float lod = max(0, log2(2 * spacing / wakeCellSize));
+    return wakeMap.SampleLevel(wakeSampler, uv, lod);
+}
+
+// full resolution wake slope (dh/dx, dh/dz) at world position p, per pixel
+float2 WakeSlope(float2 p)
+{
+    float2 uv = (p - wakeOrigin) * wakeInvExtent;
+    float2 texel = float2(wakeCellSize * wakeInvExtent, 0);
+    float dx = wakeMap.SampleLevel(wakeSampler, uv + texel.xy, 0)
+             - wakeMap.SampleLevel(wakeSampler, uv - texel.xy, 0);
+    float dz = wakeMap.SampleLevel(wakeSampler, uv + texel.yx, 0)
+             - wakeMap.SampleLevel(wakeSampler, uv - texel.yx, 0);
+    return float2(dx, dz) / (2 * wakeCellSize);
+}
+
+float3 InstanceTransform(WATER_INSTANCE instance, float4 p)
+{
+    return float3(dot(instance.world0, p), dot(instance.world1, p), dot(instance.world2, p));
+}
+
+float3 InstanceNormal(WATER_INSTANCE instance, float3 n)
+{
+    return normalize(float3(dot(instance.normal0, n), dot(instance.normal1, n), dot(instance.normal2, n)));
+}
+
+// water bodies carry their own transform, world is identity for them
+void WaterVS(float3 pos : POSITION, WATER_INSTANCE instance, out PS_INPUT result)
+{
+    float3 worldPos = InstanceTransform(instance, float4(pos, 1));
+    // waves are evaluated in body space, so is the cutoff
+    float cutoff = max(bandNyquist, distance(worldPos, bandEye) * bandScale / instance.params.y);
+    WAVE_SUM waveSum = GerstnerWaveSum(pos.xz, waveBuffer, instance.waves.x, instance.waves.y,
+                                       instance.params.x, cutoff);
+    worldPos = InstanceTransform(instance, float4(waveSum.pos, 1));
+    worldPos.y += WakeHeight(worldPos.xz, wakeMeshSpacing * instance.params.y);
+    float3 norm = InstanceNormal(instance, waveSum.norm);
+	result.pos = mul(worldViewProjection, float4(worldPos, 1));
+    result.norm = norm;
+    result.vPos = worldPos;
+    result.color = instance.color;
+    result.fresnel = instance.fresnel;
 }
 
 void SkyVS(float3 pos : POSITION, out float4 oPos : SV_Position, out float3 vPos : TEXCOORD)
@@ -99,6 +178,11 @@ void WaterPS(PS_INPUT input, out float4 color : SV_Target)
 {
     float3 p = input.vPos;
     float3 n = normalize(input.norm);
+    // the wake is a world space height field: add its slope to the surface
+    // slope, n / n.y, scaled back by n.y so it fades out on steep or tilted
+    // bodies instead of dividing by zero
+    float2 wake = WakeSlope(p.xz);
+    n = normalize(n - max(n.y, 0) * float3(wake.x, 0, wake.y));
     float3 i = normalize(p - eyePos);
     float3 r = reflect(i, n);
     float3 l = normalize(lightDir);
@@ -107,9 +191,13 @@ void WaterPS(PS_INPUT input, out float4 color : SV_Target)
     float3 tGreen = refract(i, n, etaRatio.g);
     float3 tBlue = refract(i, n, etaRatio.b);
     
-    float reflectionFactor = fresnelBias +
-                             fresnelScale * pow(1 + dot(i, n),
-                                                 fresnelPower);
+    float3 waterColor = input.color.rgb;
+    float reflectivity = input.color.a;
+    float transmittance = input.fresnel.x;
+
+    float reflectionFactor = input.fresnel.z +
+                             input.fresnel.y * pow(1 + dot(i, n),
+                                                   input.fresnel.w);
 
     float3 reflectedColor = lerp(waterColor, cubeMap.Sample(anisotropic, r), reflectivity);
     
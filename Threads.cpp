@@ -0,0 +1,246 @@
+#include "Threads.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+struct ThreadStart
+{
+    ThreadProc proc;
+    void * arg;
+};
+
+#ifdef _WIN32
+
+static DWORD WINAPI ThreadEntry(LPVOID param)
+{
+    ThreadStart start = *(ThreadStart*)param;
+    delete (ThreadStart*)param;
+    start.proc(start.arg);
+    return 0;
+}
+
+bool StartThread(Thread * thread, ThreadProc proc, void * arg)
+{
+    ThreadStart * start = new ThreadStart;
+    start->proc = proc;
+    start->arg = arg;
+    *thread = CreateThread(NULL, 0, ThreadEntry, start, 0, NULL);
+    if(!*thread)
+    {
+        delete start;
+        return false;
+    }
+    return true;
+}
+
+void JoinThread(Thread thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+void YieldThread()
+{
+    SwitchToThread();
+}
+
+int GetProcessorCount()
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+}
+
+double GetSeconds()
+{
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return counter.QuadPart / (double)frequency.QuadPart;
+}
+
+void * AllocAligned(size_t size, size_t align)
+{
+    return _aligned_malloc(size, align);
+}
+
+void FreeAligned(void * p)
+{
+    _aligned_free(p);
+}
+
+long AtomicIncrement(volatile long * p)
+{
+    return InterlockedIncrement(p);
+}
+
+long AtomicDecrement(volatile long * p)
+{
+    return InterlockedDecrement(p);
+}
+
+long AtomicAdd(volatile long * p, long value)
+{
+    return InterlockedExchangeAdd(p, value) + value;
+}
+
+long AtomicCompareExchange(volatile long * p, long exchange, long comparand)
+{
+    return InterlockedCompareExchange(p, exchange, comparand);
+}
+
+void MemoryFence()
+{
+    MemoryBarrier();
+}
+
+bool InitSemaphore(Semaphore * semaphore, int max)
+{
+    semaphore->handle = CreateSemaphoreW(NULL, 0, max, NULL);
+    return semaphore->handle != NULL;
+}
+
+void DestroySemaphore(Semaphore * semaphore)
+{
+    CloseHandle(semaphore->handle);
+}
+
+void SignalSemaphore(Semaphore * semaphore)
+{
+    ReleaseSemaphore(semaphore->handle, 1, NULL);
+}
+
+void WaitSemaphore(Semaphore * semaphore)
+{
+    WaitForSingleObject(semaphore->handle, INFINITE);
+}
+
+#else
+
+static void * ThreadEntry(void * param)
+{
+    ThreadStart start = *(ThreadStart*)param;
+    delete (ThreadStart*)param;
+    start.proc(start.arg);
+    return NULL;
+}
+
+bool StartThread(Thread * thread, ThreadProc proc, void * arg)
+{
+    ThreadStart * start = new ThreadStart;
+    start->proc = proc;
+    start->arg = arg;
+    if(pthread_create(thread, NULL, ThreadEntry, start))
+    {
+        delete start;
+        return false;
+    }
+    return true;
+}
+
+void JoinThread(Thread thread)
+{
+    pthread_join(thread, NULL);
+}
+
+void YieldThread()
+{
+    sched_yield();
+}
+
+int GetProcessorCount()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+double GetSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void * AllocAligned(size_t size, size_t align)
+{
+    void * p;
+    return posix_memalign(&p, align, size) == 0 ? p : NULL;
+}
+
+void FreeAligned(void * p)
+{
+    free(p);
+}
+
+long AtomicIncrement(volatile long * p)
+{
+    return __sync_add_and_fetch(p, 1);
+}
+
+long AtomicDecrement(volatile long * p)
+{
+    return __sync_sub_and_fetch(p, 1);
+}
+
+long AtomicAdd(volatile long * p, long value)
+{
+    return __sync_add_and_fetch(p, value);
+}
+
+long AtomicCompareExchange(volatile long * p, long exchange, long comparand)
+{
+    return __sync_val_compare_and_swap(p, comparand, exchange);
+}
+
+void MemoryFence()
+{
+    __sync_synchronize();
+}
+
+bool InitSemaphore(Semaphore * semaphore, int max)
+{
+    semaphore->count = 0;
+    semaphore->max = max;
+    if(pthread_mutex_init(&semaphore->mutex, NULL))
+        return false;
+    if(pthread_cond_init(&semaphore->cond, NULL))
+    {
+        pthread_mutex_destroy(&semaphore->mutex);
+        return false;
+    }
+    return true;
+}
+
+void DestroySemaphore(Semaphore * semaphore)
+{
+    pthread_cond_destroy(&semaphore->cond);
+    pthread_mutex_destroy(&semaphore->mutex);
+}
+
+void SignalSemaphore(Semaphore * semaphore)
+{
+    pthread_mutex_lock(&semaphore->mutex);
+    if(semaphore->count < semaphore->max)
+    {
+        ++semaphore->count;
+        pthread_cond_signal(&semaphore->cond);
+    }
+    pthread_mutex_unlock(&semaphore->mutex);
+}
+
+void WaitSemaphore(Semaphore * semaphore)
+{
+    pthread_mutex_lock(&semaphore->mutex);
+    while(!semaphore->count)
+        pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+    --semaphore->count;
+    pthread_mutex_unlock(&semaphore->mutex);
+}
+
+#endif
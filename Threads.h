@@ -0,0 +1,58 @@
+#ifndef REEF_THREADS_H
+#define REEF_THREADS_H
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+typedef HANDLE Thread;
+#else
+#include <pthread.h>
+typedef pthread_t Thread;
+#endif
+
+#include <stddef.h>
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+struct Semaphore
+{
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int count;
+    int max;
+#endif
+};
+
+typedef void (*ThreadProc)(void * arg);
+
+bool StartThread(Thread * thread, ThreadProc proc, void * arg);
+void JoinThread(Thread thread);
+void YieldThread();
+int GetProcessorCount();
+double GetSeconds();
+// Memory aligned for SIMD loads and stores; release it with FreeAligned.
+void * AllocAligned(size_t size, size_t align);
+void FreeAligned(void * p);
+
+long AtomicIncrement(volatile long * p);
+long AtomicDecrement(volatile long * p);
+long AtomicAdd(volatile long * p, long value);
+long AtomicCompareExchange(volatile long * p, long exchange, long comparand);
+void MemoryFence();
+
+// Signals beyond max are dropped, so redundant wakeups can not pile up.
+bool InitSemaphore(Semaphore * semaphore, int max);
+void DestroySemaphore(Semaphore * semaphore);
+void SignalSemaphore(Semaphore * semaphore);
+void WaitSemaphore(Semaphore * semaphore);
+
+#endif
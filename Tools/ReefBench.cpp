@@ -0,0 +1,823 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "FrameArena.h"
+#include "Jobs.h"
+#include "Phasors.h"
+#include "Wake.h"
+#include "WaterBodies.h"
+#include "Waves.h"
+
+#include <vector>
+
+// every heap allocation made through new is counted, so frames can be checked
+// for zero mallocs once the arenas are warm
+static volatile long heapAllocations = 0;
+
+void * operator new(size_t size)
+{
+    AtomicIncrement(&heapAllocations);
+    void * p = malloc(size ? size : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void * p) throw()
+{
+    free(p);
+}
+
+void operator delete(void * p, size_t) throw()
+{
+    operator delete(p);
+}
+
+static void DefaultWakeParams(WakeParams * params)
+{
+    params->cells = WAKE_CELLS;
+    params->cellSize = WAKE_CELL_SIZE;
+    params->speed = WAKE_SPEED;
+    params->damping = WAKE_DAMPING;
+    params->spongeCells = WAKE_SPONGE;
+}
+
+static bool BenchWake()
+{
+    WakeParams params;
+    DefaultWakeParams(&params);
+    printf("wake: courant %.3f at dt %.4f s (limit 0.707), %s\n",
+           WakeCourantNumber(params, WAKE_TIMESTEP), WAKE_TIMESTEP,
+           IsWakeStable(params, WAKE_TIMESTEP) ? "stable" : "UNSTABLE");
+
+    int procs = GetProcessorCount();
+    int sizes[] = { 256, 512, 1024 };
+    for(int s = 0; s < 3; ++s)
+    {
+        WakeParams p = params;
+        p.cells = sizes[s];
+        Wake wake;
+        if(!CreateWake(&wake, p, WAKE_TIMESTEP))
+            return false;
+        for(int threads = 1; ; threads *= 2)
+        {
+            if(threads > procs)
+                threads = procs;
+            InitJobs(threads);
+            ClearWake(&wake);
+            DisturbWake(&wake, 0, 0, 0.1f, 0.01f);
+            int steps = 0;
+            double start = GetSeconds(), elapsed;
+            do
+            {
+                StepWake(&wake);
+                ++steps;
+                elapsed = GetSeconds() - start;
+            } while(elapsed < 0.25);
+            ShutdownJobs();
+            printf("wake: %4d x %-4d %2d threads %8.1f Mcells/s\n",
+                   p.cells, p.cells, threads,
+                   (double)p.cells * p.cells * steps / elapsed * 1e-6);
+            if(threads == procs)
+                break;
+        }
+        DestroyWake(&wake);
+    }
+
+    // drive the default grid with impulses for a minute of simulated time,
+    // then let it settle: energy must stay bounded and drain through the sponge
+    Wake wake;
+    if(!CreateWake(&wake, params, WAKE_TIMESTEP))
+        return false;
+    srand(1);
+    float extent = params.cells * params.cellSize;
+    float peak = 0, maxHeight = 0;
+    int drive = (int)(60 / WAKE_TIMESTEP);
+    for(int i = 0; i < drive; ++i)
+    {
+        if(i % 10 == 0)
+            DisturbWake(&wake,
+                        (rand() / (float)RAND_MAX - 0.5f) * extent * 0.8f,
+                        (rand() / (float)RAND_MAX - 0.5f) * extent * 0.8f,
+                        0.03f, -0.004f);
+        StepWake(&wake);
+        float e = WakeEnergy(&wake);
+        if(e > peak)
+            peak = e;
+    }
+    for(int o = 0; o < params.cells * params.cells; ++o)
+        if(fabsf(wake.height[o]) > maxHeight)
+            maxHeight = fabsf(wake.height[o]);
+    for(int i = 0; i < drive; ++i)
+        StepWake(&wake);
+    float residual = WakeEnergy(&wake);
+    DestroyWake(&wake);
+    bool stable = maxHeight == maxHeight && maxHeight < 0.1f
+                  && residual == residual && residual < peak * 1e-3f;
+    printf("wake: stability peak energy %g, max |h| %g, residual %g after 60 s: %s\n",
+           peak, maxHeight, residual, stable ? "PASS" : "FAIL");
+    return stable;
+}
+
+// 64 waves from 20 down to 0.05 units at constant steepness, random directions
+static void MakeWaves(Wave * waves, int n)
+{
+    srand(2);
+    for(int i = 0; i < n; ++i)
+    {
+        float angle = rand() / (float)RAND_MAX * 2 * WAVE_PI;
+        waves[i].dir.x = cosf(angle);
+        waves[i].dir.y = sinf(angle);
+        waves[i].length = 20 * powf(0.05f / 20, i / (float)(n - 1));
+        waves[i].amp = waves[i].length * 0.004f;
+    }
+    SortWavesByLength(waves, n);
+}
+
+static bool BenchBand()
+{
+    const int waveCount = 64;
+    const int cells = 512;
+    const float spacing = 0.2f;
+    const float eyeHeight = 2;
+    Wave waves[waveCount];
+    MakeWaves(waves, waveCount);
+
+    // 1080 lines, 45 degree vertical field of view, 4 pixels per wavelength
+    WaveBand bands[2];
+    bands[0].nyquist = 0;
+    bands[0].scale = 4 * 2 * tanf(WAVE_PI / 8) / 1080;
+    bands[1].nyquist = 2 * spacing;
+    bands[1].scale = bands[0].scale;
+    const char * names[2] = { "screen", "screen+mesh" };
+
+    int vertices = cells * cells;
+    WaveSum * full = new WaveSum[vertices];
+    double start = GetSeconds();
+    for(int j = 0; j < cells; ++j)
+        for(int i = 0; i < cells; ++i)
+            GerstnerWaveSum(waves, waveCount, 0.8f, 0.3f,
+                            i * spacing, j * spacing, 0, &full[j * cells + i]);
+    double fullTime = GetSeconds() - start;
+
+    double heightSq = 0;
+    for(int v = 0; v < vertices; ++v)
+        heightSq += full[v].pos[1] * full[v].pos[1];
+    printf("band: %d waves, %d x %d grid, full sum %.1f ns/vertex\n",
+           waveCount, cells, cells, fullTime / vertices * 1e9);
+
+    for(int b = 0; b < 2; ++b)
+    {
+        double evaluated = 0, posSq = 0, normSq = 0;
+        WaveSum sum;
+        start = GetSeconds();
+        for(int j = 0; j < cells; ++j)
+        {
+            for(int i = 0; i < cells; ++i)
+            {
+                float x = i * spacing, z = j * spacing;
+                float d = sqrtf(x * x + z * z + eyeHeight * eyeHeight);
+                evaluated += GerstnerWaveSum(waves, waveCount, 0.8f, 0.3f, x, z,
+                                             WaveCutoff(bands[b], d), &sum);
+                const WaveSum & ref = full[j * cells + i];
+                for(int k = 0; k < 3; ++k)
+                {
+                    posSq += (sum.pos[k] - ref.pos[k]) * (sum.pos[k] - ref.pos[k]);
+                    normSq += (sum.norm[k] - ref.norm[k]) * (sum.norm[k] - ref.norm[k]);
+                }
+            }
+        }
+        double bandTime = GetSeconds() - start;
+        printf("band: %-11s %5.1f waves/vertex %6.1f ns/vertex speedup %5.2fx"
+               " rms pos error %.3g (%.1f%% of rms height) rms normal error %.3g\n",
+               names[b], evaluated / vertices, bandTime / vertices * 1e9,
+               fullTime / bandTime, sqrt(posSq / vertices),
+               100 * sqrt(posSq / heightSq), sqrt(normSq / vertices));
+    }
+    delete [] full;
+    return true;
+}
+
+struct WaveGrid
+{
+    const Wave * waves;
+    int waveCount;
+    int cells;
+    float spacing;
+    WaveSum * sums;
+};
+
+static void EvaluateWaveRows(void * context, int begin, int end)
+{
+    WaveGrid * grid = (WaveGrid*)context;
+    for(int j = begin; j < end; ++j)
+        for(int i = 0; i < grid->cells; ++i)
+            GerstnerWaveSum(grid->waves, grid->waveCount, 0.8f, 0.3f,
+                            i * grid->spacing, j * grid->spacing, 0,
+                            &grid->sums[j * grid->cells + i]);
+}
+
+static volatile long dependencyHits;
+static volatile long dependencyErrors;
+
+static void CountJob(void * data)
+{
+    AtomicIncrement((volatile long*)data);
+}
+
+static void CheckDependencyJob(void * data)
+{
+    if(*(volatile long*)data != 1000)
+        AtomicIncrement(&dependencyErrors);
+    AtomicIncrement(&dependencyHits);
+}
+
+static void EmptyJob(void *)
+{
+}
+
+static volatile long nestedRuns;
+
+// each level waits on the next, so every level's job record stays busy
+// until the innermost one has run
+static void NestJob(void * data)
+{
+    int depth = (int)(size_t)data;
+    AtomicIncrement(&nestedRuns);
+    if(depth <= 1)
+        return;
+    JobCounter counter;
+    InitJobCounter(&counter);
+    RunJob(NestJob, (void*)(size_t)(depth - 1), &counter);
+    WaitForJobCounter(&counter);
+}
+
+static bool BenchJobs()
+{
+    int procs = GetProcessorCount();
+    printf("jobs: %d hardware threads\n", procs);
+
+    // dependencies: the checker must only run after all producers finished
+    bool ok = true;
+    for(int workers = 1; workers <= 64; workers *= 4)
+    {
+        InitJobs(workers);
+        volatile long produced = 0;
+        dependencyHits = dependencyErrors = 0;
+        JobCounter producers, checkers;
+        InitJobCounter(&producers);
+        InitJobCounter(&checkers);
+        for(int i = 0; i < 1000; ++i)
+            RunJob(CountJob, (void*)&produced, &producers);
+        for(int i = 0; i < 8; ++i)
+            RunJob(CheckDependencyJob, (void*)&produced, &checkers, &producers);
+        WaitForJobCounter(&checkers);
+        ShutdownJobs();
+        bool pass = dependencyHits == 8 && !dependencyErrors && produced == 1000;
+        printf("jobs: dependencies with %2d workers: %s\n", workers, pass ? "PASS" : "FAIL");
+        ok = ok && pass;
+    }
+
+    // jobs nested deeper than the job pool wrap onto records still running
+    // up the stack; they must take overflow records rather than wait forever,
+    // and run on the spot once those are used up, all without allocating
+    const int depths[] = { JOB_POOL_SIZE + JOB_POOL_SIZE / 2,
+                           JOB_POOL_SIZE + JOB_OVERFLOW_SIZE + JOB_POOL_SIZE / 2 };
+    for(int d = 0; d < 2; ++d)
+    {
+        for(int workers = 1; workers <= 4; workers *= 4)
+        {
+            InitJobs(workers);
+            nestedRuns = 0;
+            JobStats before, after;
+            GetJobStats(&before);
+            long mallocs = heapAllocations;
+            JobCounter counter;
+            InitJobCounter(&counter);
+            RunJob(NestJob, (void*)(size_t)depths[d], &counter);
+            WaitForJobCounter(&counter);
+            mallocs = heapAllocations - mallocs;
+            GetJobStats(&after);
+            ShutdownJobs();
+            bool pass = nestedRuns == depths[d] && !mallocs;
+            printf("jobs: %d nested jobs with %d workers, %ld overflow records,"
+                   " %ld heap allocations: %s\n", depths[d], workers,
+                   after.overflowed - before.overflowed, mallocs, pass ? "PASS" : "FAIL");
+            ok = ok && pass;
+        }
+    }
+
+    // submit and run empty jobs from the main thread
+    InitJobs(procs);
+    JobCounter counter;
+    InitJobCounter(&counter);
+    const int empties = 200000;
+    double start = GetSeconds();
+    for(int i = 0; i < empties; ++i)
+        RunJob(EmptyJob, NULL, &counter);
+    WaitForJobCounter(&counter);
+    double elapsed = GetSeconds() - start;
+    ShutdownJobs();
+    printf("jobs: %d empty jobs on %d workers, %.0f ns/job\n",
+           empties, procs, elapsed / empties * 1e9);
+
+    // parallel-for scaling over a Gerstner grid
+    const int waveCount = 16;
+    Wave waves[64];
+    MakeWaves(waves, 64);
+    WaveGrid grid;
+    grid.waves = waves;
+    grid.waveCount = waveCount;
+    grid.cells = 384;
+    grid.spacing = 0.05f;
+    grid.sums = new WaveSum[grid.cells * grid.cells];
+    double base = 0;
+    for(int workers = 1; workers <= 64; workers *= 2)
+    {
+        InitJobs(workers);
+        JobStats before, after;
+        GetJobStats(&before);
+        int runs = 0;
+        start = GetSeconds();
+        do
+        {
+            ParallelFor(grid.cells, 0, EvaluateWaveRows, &grid);
+            ++runs;
+            elapsed = GetSeconds() - start;
+        } while(elapsed < 0.5);
+        GetJobStats(&after);
+        ShutdownJobs();
+        double t = elapsed / runs;
+        if(workers == 1)
+            base = t;
+        printf("jobs: parallel-for %2d workers %8.2f ms speedup %5.2fx efficiency %5.1f%%"
+               " steals/run %.1f%s\n",
+               workers, t * 1e3, base / t, 100 * base / t / workers,
+               (after.stolen - before.stolen) / (double)runs,
+               workers > procs ? " (oversubscribed)" : "");
+    }
+    delete [] grid.sums;
+    return ok;
+}
+
+struct ArenaFrame
+{
+    int chunks;
+    volatile long scratchBytes;
+};
+
+static void ArenaScratchJob(void * context, int begin, int end)
+{
+    ArenaFrame * frame = (ArenaFrame*)context;
+    for(int i = begin; i < end; ++i)
+    {
+        char * scratch = (char*)FrameAlloc(1024);
+        memset(scratch, i, 1024);
+        AtomicAdd(&frame->scratchBytes, 1024);
+    }
+}
+
+struct ArenaDraw
+{
+    float world[16];
+    int body;
+};
+
+// one frame of typical transient work: a cull list, a draw list built from
+// it, an upload staging block and per-job scratch from workers
+static void SimulateArenaFrame(int bodies)
+{
+    BeginFrameArena();
+    std::vector<int, FrameAllocator<int> > visible;
+    visible.reserve(bodies);
+    for(int i = 0; i < bodies; ++i)
+        if(i % 3)
+            visible.push_back(i);
+    std::vector<ArenaDraw, FrameAllocator<ArenaDraw> > draws;
+    draws.reserve(visible.size());
+    for(size_t i = 0; i < visible.size(); ++i)
+    {
+        ArenaDraw draw;
+        memset(draw.world, 0, sizeof(draw.world));
+        draw.body = visible[i];
+        draws.push_back(draw);
+    }
+    float * upload = (float*)FrameAlloc(64 * 1024);
+    memset(upload, 0, 64 * 1024);
+    ArenaFrame frame;
+    frame.chunks = 64;
+    frame.scratchBytes = 0;
+    ParallelFor(frame.chunks, 1, ArenaScratchJob, &frame);
+}
+
+static bool BenchArena()
+{
+    const int bodies = 4096;
+    const int frames = 1000;
+    bool ok = true;
+
+    InitJobs();
+    InitFrameArenas(1 << 20);
+    long mallocs = 0, fallbacks = 0;
+    for(int f = 0; f < frames; ++f)
+    {
+        long before = heapAllocations;
+        SimulateArenaFrame(bodies);
+        FrameArenaStats stats;
+        GetFrameArenaStats(&stats);
+        if(f > FRAME_ARENA_COUNT)
+        {
+            mallocs += heapAllocations - before;
+            fallbacks += stats.fallbackCount;
+        }
+    }
+    FrameArenaStats stats;
+    GetFrameArenaStats(&stats);
+    bool pass = !mallocs && !fallbacks;
+    printf("arena: %d steady frames, high water %lu of %lu bytes, %ld heap allocations,"
+           " %ld fallbacks: %s\n",
+           frames - FRAME_ARENA_COUNT - 1, (unsigned long)stats.highWater,
+           (unsigned long)stats.capacity, mallocs, fallbacks, pass ? "PASS" : "FAIL");
+    ok = ok && pass;
+
+    // an undersized arena must report its overflow
+    InitFrameArenas(16 * 1024);
+    SimulateArenaFrame(bodies);
+    GetFrameArenaStats(&stats);
+    pass = stats.fallbackCount > 0;
+    printf("arena: undersized arena fell back %ld times (%lu bytes): %s\n",
+           stats.fallbackCount, (unsigned long)stats.fallbackBytes, pass ? "PASS" : "FAIL");
+    ok = ok && pass;
+    ShutdownJobs();
+
+    InitFrameArenas(64 << 20);
+    const int allocations = 1000000;
+    double start = GetSeconds();
+    for(int i = 0; i < allocations; ++i)
+    {
+        if(i % 100000 == 0)
+            BeginFrameArena();
+        *(volatile char*)FrameAlloc(48) = 0;
+    }
+    double arenaTime = GetSeconds() - start;
+    start = GetSeconds();
+    for(int i = 0; i < allocations; ++i)
+    {
+        char * p = (char*)malloc(48);
+        *(volatile char*)p = 0;
+        free(p);
+    }
+    double heapTime = GetSeconds() - start;
+    ShutdownFrameArenas();
+    printf("arena: 48 byte allocation %.1f ns, malloc/free %.1f ns\n",
+           arenaTime / allocations * 1e9, heapTime / allocations * 1e9);
+    return ok;
+}
+
+static void MakeGridPoints(std::vector<float> & x, std::vector<float> & z, int cells, float spacing)
+{
+    x.resize(cells * cells);
+    z.resize(cells * cells);
+    for(int j = 0; j < cells; ++j)
+    {
+        for(int i = 0; i < cells; ++i)
+        {
+            x[j * cells + i] = i * spacing;
+            z[j * cells + i] = j * spacing;
+        }
+    }
+}
+
+static double MaxWaveSumError(const Wave * waves, int n, float time, const std::vector<float> & x,
+                              const std::vector<float> & z, const WaveSum * sums, double * normError)
+{
+    double posError = 0;
+    *normError = 0;
+    for(size_t v = 0; v < x.size(); ++v)
+    {
+        WaveSum ref;
+        GerstnerWaveSum(waves, n, 0.8f, time, x[v], z[v], 0, &ref);
+        for(int k = 0; k < 3; ++k)
+        {
+            double dp = fabs(sums[v].pos[k] - ref.pos[k]);
+            double dn = fabs(sums[v].norm[k] - ref.norm[k]);
+            posError = dp > posError ? dp : posError;
+            *normError = dn > *normError ? dn : *normError;
+        }
+    }
+    return posError;
+}
+
+static bool BenchPhasors()
+{
+    // memory against speed for a single thread, one step per frame of 60 Hz
+    // with the 5 second wave interval used by the viewer
+    const float dt = 1.0f / 300;
+    const int gridSizes[] = { 64, 256, 512 };
+    const int waveCounts[] = { 8, 32, 64 };
+    Wave waves[64];
+    bool ok = true;
+    for(int g = 0; g < 3; ++g)
+    {
+        int cells = gridSizes[g];
+        std::vector<float> x, z;
+        MakeGridPoints(x, z, cells, 0.2f);
+        int vertices = cells * cells;
+        std::vector<WaveSum> sums(vertices);
+        int frames = 512 * 512 / vertices;
+        for(int w = 0; w < 3; ++w)
+        {
+            int n = waveCounts[w];
+            MakeWaves(waves, n);
+            float time = 0;
+            double start = GetSeconds();
+            for(int f = 0; f < frames; ++f)
+            {
+                time += dt;
+                for(int v = 0; v < vertices; ++v)
+                    GerstnerWaveSum(waves, n, 0.8f, time, x[v], z[v], 0, &sums[v]);
+            }
+            double directTime = GetSeconds() - start;
+
+            WavePhasors phasors;
+            if(!CreateWavePhasors(&phasors, waves, n, 0.8f, &x[0], &z[0], vertices, 0))
+            {
+                printf("phasor: out of memory for %d x %d grid, %d waves\n", cells, cells, n);
+                ok = false;
+                continue;
+            }
+            time = 0;
+            start = GetSeconds();
+            for(int f = 0; f < frames; ++f)
+            {
+                time += dt;
+                UpdateWavePhasors(&phasors, time, &sums[0]);
+            }
+            double phasorTime = GetSeconds() - start;
+            double normError;
+            double posError = MaxWaveSumError(waves, n, time, x, z, &sums[0], &normError);
+            printf("phasor: %3d x %-3d grid %2d waves %7.1f MB direct %6.1f ns/vertex"
+                   " incremental %5.1f ns/vertex speedup %5.2fx max pos error %.2g\n",
+                   cells, cells, n, WavePhasorBytes(&phasors) / (1024.0 * 1024.0),
+                   directTime / frames / vertices * 1e9, phasorTime / frames / vertices * 1e9,
+                   directTime / phasorTime, posError);
+            DestroyWavePhasors(&phasors);
+        }
+    }
+
+    // long runs with the time wrapping the way the viewer does, checking the
+    // drift against the direct sum as it goes
+    const int driftFrames = 1000000;
+    const int checkInterval = 50000;
+    const int resyncIntervals[] = { 0, PHASOR_RESYNC_INTERVAL };
+    const int driftWaves = 16;
+    MakeWaves(waves, driftWaves);
+    std::vector<float> x, z;
+    MakeGridPoints(x, z, 8, 1.3f);
+    std::vector<WaveSum> sums(x.size());
+    for(int r = 0; r < 2; ++r)
+    {
+        WavePhasors phasors;
+        CreateWavePhasors(&phasors, waves, driftWaves, 0.8f, &x[0], &z[0], (int)x.size(), 0);
+        phasors.resyncInterval = resyncIntervals[r];
+        float time = 0;
+        double maxPos = 0, maxNorm = 0;
+        for(int f = 1; f <= driftFrames; ++f)
+        {
+            time += dt;
+            if(time > 1)
+                time -= 1;
+            UpdateWavePhasors(&phasors, time, &sums[0]);
+            if(f % checkInterval == 0)
+            {
+                double normError;
+                double posError = MaxWaveSumError(waves, driftWaves, time, x, z, &sums[0], &normError);
+                maxPos = posError > maxPos ? posError : maxPos;
+                maxNorm = normError > maxNorm ? normError : maxNorm;
+            }
+        }
+        DestroyWavePhasors(&phasors);
+        printf("phasor: drift over %d frames, resync every %d frames: max pos error %.2g"
+               " max normal error %.2g",
+               driftFrames, resyncIntervals[r], maxPos, maxNorm);
+        if(!resyncIntervals[r])
+        {
+            printf("\n");
+            continue;
+        }
+        // 1e-4 of the 0.08 unit amplitude of the longest wave
+        bool pass = maxPos < 8e-6 && maxNorm < 1e-4;
+        printf(": %s\n", pass ? "PASS" : "FAIL");
+        ok = ok && pass;
+    }
+    return ok;
+}
+
+// row-vector view and projection matrices matching XMMatrixLookAtLH and
+// XMMatrixPerspectiveFovLH
+static void MakeViewProjection(const float eye[3], float yaw, float pitch, float aspect,
+                               float viewProjection[4][4])
+{
+    float z[3] = { cosf(pitch) * cosf(yaw), sinf(pitch), cosf(pitch) * sinf(yaw) };
+    float x[3] = { z[2], 0, -z[0] };
+    float length = sqrtf(x[0] * x[0] + x[2] * x[2]);
+    x[0] /= length;
+    x[2] /= length;
+    float y[3] = { z[1] * x[2] - z[2] * x[1], z[2] * x[0] - z[0] * x[2], z[0] * x[1] - z[1] * x[0] };
+    float view[4][4] =
+    {
+        { x[0], y[0], z[0], 0 },
+        { x[1], y[1], z[1], 0 },
+        { x[2], y[2], z[2], 0 },
+        { -(x[0] * eye[0] + x[1] * eye[1] + x[2] * eye[2]),
+          -(y[0] * eye[0] + y[1] * eye[1] + y[2] * eye[2]),
+          -(z[0] * eye[0] + z[1] * eye[1] + z[2] * eye[2]), 1 }
+    };
+    float n = 0.1f, f = 1000;
+    float ys = 1 / tanf(WAVE_PI / 8), xs = ys / aspect;
+    float projection[4][4] =
+    {
+        { xs, 0, 0, 0 },
+        { 0, ys, 0, 0 },
+        { 0, 0, f / (f - n), 1 },
+        { 0, 0, -n * f / (f - n), 0 }
+    };
+    for(int r = 0; r < 4; ++r)
+        for(int c = 0; c < 4; ++c)
+            viewProjection[r][c] = view[r][0] * projection[0][c] + view[r][1] * projection[1][c]
+                                   + view[r][2] * projection[2][c] + view[r][3] * projection[3][c];
+}
+
+// scalar culling with the same arithmetic, for checking the SIMD path
+static int ReferenceCull(const WaterBodies * bodies, const WaterFrustum & frustum,
+                         std::vector<unsigned> * visible)
+{
+    visible->clear();
+    for(int b = 0; b < bodies->count; ++b)
+    {
+        bool inside = true;
+        for(int p = 0; p < 6; ++p)
+        {
+            const float * plane = frustum.planes[p];
+            float d = (bodies->centerX[b] * plane[0] + bodies->centerY[b] * plane[1])
+                      + (bodies->centerZ[b] * plane[2] + plane[3]);
+            inside = inside && d >= -bodies->radius[b];
+        }
+        if(inside)
+            visible->push_back(bodies->instances[b].waveOffset);
+    }
+    return (int)visible->size();
+}
+
+static bool BenchBodies()
+{
+    const int bodyCount = 10000;
+    const int frames = 200;
+    const float world = 2000;
+    Wave pool[64];
+    MakeWaves(pool, 64);
+    bool ok = true;
+
+    InitJobs();
+    InitFrameArenas(8 << 20);
+    WaterBodies bodies;
+    if(!CreateWaterBodies(&bodies, bodyCount, bodyCount * 16))
+    {
+        printf("bodies: out of memory\n");
+        return false;
+    }
+    srand(3);
+    double start = GetSeconds();
+    for(int i = 0; i < bodyCount; ++i)
+    {
+        WaterBodyDesc desc;
+        int first = rand() % 48;
+        desc.waves = pool + first;
+        desc.waveCount = 4 + rand() % 13;
+        desc.crestFactor = 0.8f;
+        desc.meshRadius = 1.4142136f;
+        float angle = rand() / (float)RAND_MAX * 2 * WAVE_PI;
+        float scale = 1 + rand() / (float)RAND_MAX * 19;
+        float c = cosf(angle) * scale, s = sinf(angle) * scale;
+        float transform[3][4] =
+        {
+            { c, 0, s, (rand() / (float)RAND_MAX - 0.5f) * world },
+            { 0, scale, 0, 0 },
+            { -s, 0, c, (rand() / (float)RAND_MAX - 0.5f) * world }
+        };
+        memcpy(desc.transform, transform, sizeof(transform));
+        WaterMaterial material = { { 0, 0.5f, 1 }, 0.9f, 0.9f, 0.9f, 0, 1 };
+        desc.material = material;
+        if(AddWaterBody(&bodies, desc) < 0)
+            ok = false;
+    }
+    double packTime = GetSeconds() - start;
+    printf("bodies: %d bodies, %d packed waves (%lu bytes), %lu byte instances, packed in %.2f ms\n",
+           bodies.count, bodies.waveCount, (unsigned long)(bodies.waveCount * sizeof(Wave)),
+           (unsigned long)sizeof(WaterInstance), packTime * 1e3);
+
+    // a camera turning on the spot, 10 units above the middle of the field
+    float eye[3] = { 0, 10, 0 };
+    std::vector<unsigned> reference;
+    reference.reserve(bodyCount);
+    double cullTime = 0, referenceTime = 0;
+    long visibleTotal = 0, mismatches = 0, mallocs = 0;
+    for(int f = 0; f < frames; ++f)
+    {
+        BeginFrameArena();
+        long before = heapAllocations;
+        float viewProjection[4][4];
+        MakeViewProjection(eye, f * 2 * WAVE_PI / frames, -0.2f, 16.0f / 9, viewProjection);
+        WaterFrustum frustum;
+        ExtractWaterFrustum(viewProjection, &frustum);
+        start = GetSeconds();
+        WaterInstance * instances;
+        int visible = CullWaterBodies(&bodies, frustum, &instances);
+        cullTime += GetSeconds() - start;
+        if(f > FRAME_ARENA_COUNT)
+            mallocs += heapAllocations - before;
+
+        start = GetSeconds();
+        int expected = ReferenceCull(&bodies, frustum, &reference);
+        referenceTime += GetSeconds() - start;
+        visibleTotal += visible;
+        if(visible != expected)
+            ++mismatches;
+        else
+            for(int i = 0; i < visible; ++i)
+                if(instances[i].waveOffset != reference[i])
+                {
+                    ++mismatches;
+                    break;
+                }
+    }
+
+    // a point ahead of the camera must be inside and one behind it outside
+    float viewProjection[4][4];
+    MakeViewProjection(eye, 0, 0, 1, viewProjection);
+    WaterFrustum frustum;
+    ExtractWaterFrustum(viewProjection, &frustum);
+    float ahead[3] = { 50, 10, 0 }, behind[3] = { -50, 10, 0 };
+    bool aheadInside = true, behindInside = true;
+    for(int p = 0; p < 6; ++p)
+    {
+        const float * plane = frustum.planes[p];
+        aheadInside = aheadInside && plane[0] * ahead[0] + plane[1] * ahead[1] + plane[2] * ahead[2] + plane[3] >= 0;
+        behindInside = behindInside && plane[0] * behind[0] + plane[1] * behind[1] + plane[2] * behind[2] + plane[3] >= 0;
+    }
+
+    bool pass = ok && !mismatches && !mallocs && aheadInside && !behindInside;
+    printf("bodies: %d workers, cull and gather %.1f us/frame (scalar reference %.1f us),"
+           " %.0f visible, %ld mismatches, %ld heap allocations: %s\n",
+           GetJobWorkerCount(), cullTime / frames * 1e6, referenceTime / frames * 1e6,
+           visibleTotal / (double)frames, mismatches, mallocs, pass ? "PASS" : "FAIL");
+    DestroyWaterBodies(&bodies);
+    ShutdownJobs();
+    ShutdownFrameArenas();
+    return pass;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * section = argc > 1 ? argv[1] : "all";
+    bool all = !strcmp(section, "all");
+    bool ok = true;
+    bool ran = false;
+    if(all || !strcmp(section, "wake"))
+    {
+        ok = BenchWake() && ok;
+        ran = true;
+    }
+    if(all || !strcmp(section, "band"))
+    {
+        ok = BenchBand() && ok;
+        ran = true;
+    }
+    if(all || !strcmp(section, "jobs"))
+    {
+        ok = BenchJobs() && ok;
+        ran = true;
+    }
+    if(all || !strcmp(section, "arena"))
+    {
+        ok = BenchArena() && ok;
+        ran = true;
+    }
+    if(all || !strcmp(section, "phasor"))
+    {
+        ok = BenchPhasors() && ok;
+        ran = true;
+    }
+    if(all || !strcmp(section, "bodies"))
+    {
+        ok = BenchBodies() && ok;
+        ran = true;
+    }
+    if(!ran)
+    {
+        fprintf(stderr, "usage: ReefBench [all|wake|band|jobs|arena|phasor|bodies]\n");
+        return 2;
+    }
+    return ok ? 0 : 1;
+}
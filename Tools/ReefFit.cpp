@@ -0,0 +1,794 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "Jobs.h"
+#include "ToolFiles.h"
+#include "Waves.h"
+
+#include <algorithm>
+#include <vector>
+
+// Offline wave fitter: finds a few Gerstner waves that reproduce a target sea
+// state, since WaterVS pays for every wave at every vertex. The target is a
+// Pierson-Moskowitz or JONSWAP directional spectrum or a measured height
+// field, turned into a dense pool of reference waves. Waves are added one at
+// a time, each the pool wave that lowers the height error most, and after
+// every addition a coordinate search moves the direction, length and
+// amplitude of all waves so far. Errors come from GerstnerWaveSum with the
+// scene's crest factor at random points and times, and the report of error
+// against wave count is there to pick the budget.
+//
+// The crest factor moves points sideways by crestFactor / (frequency * count)
+// per wave whatever its amplitude, so the full surface error is reported but
+// not searched on; no choice of waves brings it near a dense reference.
+//
+// Wave has no phase: every wave crosses zero at the origin at time zero. A
+// measured field is therefore matched through its amplitude spectrum and the
+// errors are taken against its zero-phase resynthesis.
+
+#define FIT_MAX_WAVES 64
+#define FIT_BLOCK 256
+#define FIT_TRIALS 5
+#define FIT_ITERATIONS 24
+#define FIT_ANGLE_STEP 0.1f
+#define FIT_LENGTH_STEP 0.1f
+#define FIT_MIN_STEP (1.0f / 64)
+#define FIT_MIN_GAIN 1e-6
+#define POOL_BANDS 32
+#define POOL_SECTORS 16
+#define POOL_SIZE (POOL_BANDS * POOL_SECTORS)
+#define SPECTRUM_BANDS 8
+#define SPECTRUM_SECTORS 8
+#define PATCH_OFFSET 16
+#define PM_ALPHA 0.0081f
+
+struct Sample
+{
+    float x;
+    float z;
+    float time;
+};
+
+// surface position minus rest position
+struct Displacement
+{
+    float x;
+    float y;
+    float z;
+};
+
+// Sums over samples for a trial wave of unit amplitude, from which the best
+// amplitude and the drop in height error follow in closed form.
+struct TrialSums
+{
+    double rs;
+    double ss;
+};
+
+struct Target
+{
+    const char * name;
+    float wind;
+    float direction;
+    float spread;
+    float gamma;
+    const char * field;
+    float cell;
+    double captured;
+};
+
+struct FitContext
+{
+    float crestFactor;
+    double referenceEnergy;
+    std::vector<Sample> samples;
+    std::vector<Displacement> reference;
+    std::vector<Displacement> residual;
+    std::vector<Wave> pool;
+    std::vector<Wave> waves;
+
+    // probe state: trial waves scored against the residual with the
+    // excluded wave, if any, added back in
+    const Wave * trials;
+    int trialCount;
+    const Wave * excluded;
+    float waveCrest;
+    std::vector<TrialSums> sums;
+};
+
+static void Contribution(const Wave & wave, float crest, const Sample & s, Displacement * d)
+{
+    WaveSum sum;
+    GerstnerWaveSum(&wave, 1, crest, s.time, s.x, s.z, 0, &sum);
+    d->x = sum.pos[0] - s.x;
+    d->y = sum.pos[1];
+    d->z = sum.pos[2] - s.z;
+}
+
+static void Accumulate(const Displacement & r, const Displacement & c, TrialSums * sums)
+{
+    sums->rs += (double)r.y * c.y;
+    sums->ss += (double)c.y * c.y;
+}
+
+// Drop in squared height error from adding the trial at its best amplitude;
+// false when that amplitude is not positive, which Gerstner waves cannot take.
+static bool TrialGain(const TrialSums & sums, double * gain, float * amp)
+{
+    if(!(sums.rs > 0) || !(sums.ss > 0))
+        return false;
+    *gain = sums.rs * sums.rs / sums.ss;
+    *amp = (float)(sums.rs / sums.ss);
+    return *amp > 0;
+}
+
+static void EvaluateReference(void * data, int begin, int end)
+{
+    FitContext * context = (FitContext*)data;
+    for(int i = begin; i < end; ++i)
+    {
+        const Sample & s = context->samples[i];
+        WaveSum sum;
+        GerstnerWaveSum(&context->pool[0], (int)context->pool.size(), context->crestFactor,
+                        s.time, s.x, s.z, 0, &sum);
+        Displacement & d = context->reference[i];
+        d.x = sum.pos[0] - s.x;
+        d.y = sum.pos[1];
+        d.z = sum.pos[2] - s.z;
+    }
+}
+
+static void EvaluateResidual(void * data, int begin, int end)
+{
+    FitContext * context = (FitContext*)data;
+    for(int i = begin; i < end; ++i)
+    {
+        const Sample & s = context->samples[i];
+        Displacement & r = context->residual[i];
+        r = context->reference[i];
+        if(context->waves.empty())
+            continue;
+        WaveSum sum;
+        GerstnerWaveSum(&context->waves[0], (int)context->waves.size(), context->crestFactor,
+                        s.time, s.x, s.z, 0, &sum);
+        r.x -= sum.pos[0] - s.x;
+        r.y -= sum.pos[1];
+        r.z -= sum.pos[2] - s.z;
+    }
+}
+
+// one pool wave per item, every sample in order, so the sums do not depend
+// on the worker count
+static void ScorePool(void * data, int begin, int end)
+{
+    FitContext * context = (FitContext*)data;
+    for(int p = begin; p < end; ++p)
+    {
+        Wave unit = context->pool[p];
+        unit.amp = 1;
+        TrialSums sums = { 0, 0 };
+        for(size_t i = 0; i < context->samples.size(); ++i)
+        {
+            Displacement c;
+            Contribution(unit, context->waveCrest, context->samples[i], &c);
+            Accumulate(context->residual[i], c, &sums);
+        }
+        context->sums[p] = sums;
+    }
+}
+
+// fixed blocks of samples, summed in block order afterwards
+static void ProbeBlocks(void * data, int begin, int end)
+{
+    FitContext * context = (FitContext*)data;
+    int count = (int)context->samples.size();
+    for(int b = begin; b < end; ++b)
+    {
+        TrialSums * sums = &context->sums[b * FIT_TRIALS];
+        for(int t = 0; t < context->trialCount; ++t)
+            sums[t].rs = sums[t].ss = 0;
+        int last = (b + 1) * FIT_BLOCK < count ? (b + 1) * FIT_BLOCK : count;
+        for(int i = b * FIT_BLOCK; i < last; ++i)
+        {
+            const Sample & s = context->samples[i];
+            Displacement r = context->residual[i];
+            if(context->excluded)
+            {
+                Displacement c;
+                Contribution(*context->excluded, context->waveCrest, s, &c);
+                r.x += c.x;
+                r.y += c.y;
+                r.z += c.z;
+            }
+            for(int t = 0; t < context->trialCount; ++t)
+            {
+                Displacement c;
+                Contribution(context->trials[t], context->waveCrest, s, &c);
+                Accumulate(r, c, &sums[t]);
+            }
+        }
+    }
+}
+
+static Wave MakeWave(float angle, float logLength, float amp)
+{
+    Wave wave;
+    wave.dir.x = cosf(angle);
+    wave.dir.y = sinf(angle);
+    wave.length = expf(logLength);
+    wave.amp = amp;
+    return wave;
+}
+
+// coordinate search over direction and log length; the amplitude is solved
+// for at every step
+static void RefineWave(FitContext * context, int index)
+{
+    Wave & wave = context->waves[index];
+    // the residual still holds the wave as it was
+    Wave original = wave;
+    float angle = atan2f(wave.dir.y, wave.dir.x);
+    float logLength = logf(wave.length);
+    float angleStep = FIT_ANGLE_STEP, lengthStep = FIT_LENGTH_STEP;
+    int blocks = ((int)context->samples.size() + FIT_BLOCK - 1) / FIT_BLOCK;
+    context->sums.resize(blocks * FIT_TRIALS);
+    context->excluded = &original;
+    context->trialCount = FIT_TRIALS;
+    for(int iteration = 0; iteration < FIT_ITERATIONS && angleStep >= FIT_ANGLE_STEP * FIT_MIN_STEP;
+        ++iteration)
+    {
+        static const float angleMoves[FIT_TRIALS] = { 0, 1, -1, 0, 0 };
+        static const float lengthMoves[FIT_TRIALS] = { 0, 0, 0, 1, -1 };
+        Wave trials[FIT_TRIALS];
+        for(int t = 0; t < FIT_TRIALS; ++t)
+            trials[t] = MakeWave(angle + angleMoves[t] * angleStep,
+                                 logLength + lengthMoves[t] * lengthStep, 1);
+        context->trials = trials;
+        ParallelFor(blocks, 1, ProbeBlocks, context);
+
+        int best = -1;
+        double bestGain = 0;
+        float bestAmp = 0;
+        for(int t = 0; t < FIT_TRIALS; ++t)
+        {
+            TrialSums total = { 0, 0 };
+            for(int b = 0; b < blocks; ++b)
+            {
+                const TrialSums & s = context->sums[b * FIT_TRIALS + t];
+                total.rs += s.rs;
+                total.ss += s.ss;
+            }
+            double gain;
+            float amp;
+            if(TrialGain(total, &gain, &amp) && (best < 0 || gain > bestGain))
+            {
+                best = t;
+                bestGain = gain;
+                bestAmp = amp;
+            }
+        }
+        if(best < 0)
+            break;
+        if(best == 0)
+        {
+            angleStep *= 0.5f;
+            lengthStep *= 0.5f;
+        }
+        angle += angleMoves[best] * angleStep;
+        logLength += lengthMoves[best] * lengthStep;
+        wave = MakeWave(angle, logLength, bestAmp);
+    }
+    context->excluded = NULL;
+    ParallelFor((int)context->samples.size(), 0, EvaluateResidual, context);
+}
+
+static bool AddWave(FitContext * context)
+{
+    context->waveCrest = context->crestFactor / (context->waves.size() + 1);
+    context->sums.resize(context->pool.size());
+    ParallelFor((int)context->pool.size(), 0, ScorePool, context);
+    int best = -1;
+    double bestGain = 0;
+    float bestAmp = 0;
+    for(size_t p = 0; p < context->pool.size(); ++p)
+    {
+        double gain;
+        float amp;
+        if(TrialGain(context->sums[p], &gain, &amp) && (best < 0 || gain > bestGain))
+        {
+            best = (int)p;
+            bestGain = gain;
+            bestAmp = amp;
+        }
+    }
+    // waves that explain next to nothing only cost vertex time
+    if(best < 0 || bestGain < FIT_MIN_GAIN * context->referenceEnergy)
+        return false;
+    Wave wave = context->pool[best];
+    wave.amp = bestAmp;
+    context->waves.push_back(wave);
+    ParallelFor((int)context->samples.size(), 0, EvaluateResidual, context);
+    return true;
+}
+
+static void MeasureError(const std::vector<Displacement> & d, double * height, double * surface)
+{
+    double h = 0, s = 0;
+    for(size_t i = 0; i < d.size(); ++i)
+    {
+        h += (double)d[i].y * d[i].y;
+        s += (double)d[i].x * d[i].x + (double)d[i].y * d[i].y + (double)d[i].z * d[i].z;
+    }
+    *height = sqrt(h / d.size());
+    *surface = sqrt(s / d.size());
+}
+
+// GerstnerWaveSum advances the phase by sqrt(g * 2 pi / length) per meter
+static float WaveNumber(float length)
+{
+    return sqrtf(WAVE_G * 2 * WAVE_PI / length);
+}
+
+// Fraction of the reference energy, amp^2 / 2 per wave, that sits in the
+// wrong band of wave number and direction; 0 is a perfect match, 2 no overlap.
+static double SpectralError(const std::vector<Wave> & pool, const std::vector<Wave> & waves)
+{
+    float lo = 1e30f, hi = 0;
+    for(size_t i = 0; i < pool.size(); ++i)
+    {
+        float k = WaveNumber(pool[i].length);
+        lo = k < lo ? k : lo;
+        hi = k > hi ? k : hi;
+    }
+    float range = logf(hi / lo) * 1.0001f + 1e-6f;
+    double bins[2][SPECTRUM_BANDS * SPECTRUM_SECTORS] = { { 0 } };
+    const std::vector<Wave> * sets[2] = { &pool, &waves };
+    for(int set = 0; set < 2; ++set)
+    {
+        for(size_t i = 0; i < sets[set]->size(); ++i)
+        {
+            const Wave & wave = (*sets[set])[i];
+            int band = (int)floorf(logf(WaveNumber(wave.length) / lo) / range * SPECTRUM_BANDS);
+            band = band < 0 ? 0 : band >= SPECTRUM_BANDS ? SPECTRUM_BANDS - 1 : band;
+            float angle = atan2f(wave.dir.y, wave.dir.x) + WAVE_PI;
+            int sector = (int)(angle / (2 * WAVE_PI) * SPECTRUM_SECTORS) % SPECTRUM_SECTORS;
+            bins[set][band * SPECTRUM_SECTORS + sector] += 0.5 * wave.amp * wave.amp;
+        }
+    }
+    double total = 0, error = 0;
+    for(int b = 0; b < SPECTRUM_BANDS * SPECTRUM_SECTORS; ++b)
+    {
+        total += bins[0][b];
+        error += fabs(bins[1][b] - bins[0][b]);
+    }
+    return total > 0 ? error / total : 0;
+}
+
+// Pierson-Moskowitz, with the JONSWAP peak enhancement when gamma > 1, over
+// 0.6 to 4 times the peak frequency and cos^2s spreading; a wave of temporal
+// frequency w gets the deep water length 2 pi g / w^2.
+static void BuildSpectrumPool(const Target & target, std::vector<Wave> * pool)
+{
+    float peak = 0.877f * WAVE_G / target.wind;
+    float lo = 0.6f * peak, hi = 4 * peak;
+    float step = logf(hi / lo) / POOL_BANDS;
+    float norm = target.gamma > 1 ? 1 - 0.287f * logf(target.gamma) : 1;
+    float spreading[POOL_SECTORS];
+    float dTheta = 2 * WAVE_PI / POOL_SECTORS, spreadingSum = 0;
+    for(int j = 0; j < POOL_SECTORS; ++j)
+    {
+        float delta = (j + 0.5f) * dTheta - WAVE_PI;
+        spreading[j] = powf(cosf(delta * 0.5f), 2 * target.spread);
+        spreadingSum += spreading[j] * dTheta;
+    }
+    float direction = target.direction * WAVE_PI / 180;
+    float maxAmp = 0;
+    pool->clear();
+    for(int i = 0; i < POOL_BANDS; ++i)
+    {
+        float w = lo * expf((i + 0.5f) * step);
+        float dw = w * step;
+        float s = PM_ALPHA * WAVE_G * WAVE_G / powf(w, 5) * expf(-1.25f * powf(peak / w, 4));
+        if(target.gamma > 1)
+        {
+            float sigma = w <= peak ? 0.07f : 0.09f;
+            float r = (w - peak) / (sigma * peak);
+            s *= norm * powf(target.gamma, expf(-0.5f * r * r));
+        }
+        for(int j = 0; j < POOL_SECTORS; ++j)
+        {
+            float d = spreading[j] / spreadingSum;
+            Wave wave;
+            float angle = direction + (j + 0.5f) * dTheta - WAVE_PI;
+            wave.dir.x = cosf(angle);
+            wave.dir.y = sinf(angle);
+            wave.length = 2 * WAVE_PI * WAVE_G / (w * w);
+            wave.amp = sqrtf(2 * s * dw * d * dTheta);
+            maxAmp = wave.amp > maxAmp ? wave.amp : maxAmp;
+            pool->push_back(wave);
+        }
+    }
+    // negligible waves would only slow the search down
+    size_t kept = 0;
+    for(size_t i = 0; i < pool->size(); ++i)
+        if((*pool)[i].amp > 1e-3f * maxAmp)
+            (*pool)[kept++] = (*pool)[i];
+    pool->resize(kept);
+}
+
+// Heights in meters from a PFM, the first channel of a color one; the
+// largest power of two square from the first sample on is used.
+static bool LoadHeightField(const char * filename, int * size, std::vector<double> * heights)
+{
+    std::vector<unsigned char> data;
+    if(!ReadFile("ReefFit", filename, &data))
+        return false;
+    size_t pos = 0;
+    char magic[8], w[16], h[16], scale[32];
+    if(!ReadToken(data, &pos, magic, sizeof(magic)) || !ReadToken(data, &pos, w, sizeof(w))
+       || !ReadToken(data, &pos, h, sizeof(h)) || !ReadToken(data, &pos, scale, sizeof(scale))
+       || (strcmp(magic, "PF") && strcmp(magic, "Pf")))
+    {
+        fprintf(stderr, "ReefFit: %s is not a PFM\n", filename);
+        return false;
+    }
+    ++pos;
+    int width = atoi(w), height = atoi(h);
+    int channels = magic[1] == 'F' ? 3 : 1;
+    bool bigEndian = atof(scale) > 0;
+    if(width <= 0 || height <= 0 || data.size() < pos + (size_t)width * height * channels * 4)
+    {
+        fprintf(stderr, "ReefFit: %s is truncated\n", filename);
+        return false;
+    }
+    int n = 1;
+    while(n * 2 <= width && n * 2 <= height)
+        n *= 2;
+    if(n < 8)
+    {
+        fprintf(stderr, "ReefFit: %s is smaller than 8 x 8\n", filename);
+        return false;
+    }
+    *size = n;
+    heights->resize(n * n);
+    for(int y = 0; y < n; ++y)
+    {
+        for(int x = 0; x < n; ++x)
+        {
+            const unsigned char * s = &data[pos + ((size_t)y * width + x) * channels * 4];
+            unsigned char b[4] = { s[0], s[1], s[2], s[3] };
+            if(bigEndian)
+            {
+                b[0] = s[3];
+                b[1] = s[2];
+                b[2] = s[1];
+                b[3] = s[0];
+            }
+            float f;
+            memcpy(&f, b, 4);
+            (*heights)[y * n + x] = f;
+        }
+    }
+    return true;
+}
+
+static void FFT(double * re, double * im, int n, int stride)
+{
+    for(int i = 1, j = 0; i < n; ++i)
+    {
+        int bit = n >> 1;
+        for(; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if(i < j)
+        {
+            std::swap(re[i * stride], re[j * stride]);
+            std::swap(im[i * stride], im[j * stride]);
+        }
+    }
+    for(int length = 2; length <= n; length <<= 1)
+    {
+        double angle = -2 * 3.14159265358979 / length;
+        for(int i = 0; i < n; i += length)
+        {
+            for(int k = 0; k < length / 2; ++k)
+            {
+                double wr = cos(angle * k), wi = sin(angle * k);
+                double * ar = &re[(i + k) * stride], * ai = &im[(i + k) * stride];
+                double * br = &re[(i + k + length / 2) * stride], * bi = &im[(i + k + length / 2) * stride];
+                double tr = *br * wr - *bi * wi, ti = *br * wi + *bi * wr;
+                *br = *ar - tr;
+                *bi = *ai - ti;
+                *ar += tr;
+                *ai += ti;
+            }
+        }
+    }
+}
+
+static bool LargerAmp(const Wave & a, const Wave & b)
+{
+    return a.amp > b.amp;
+}
+
+// One wave per frequency bin in the upper half plane, amplitude 2 |F| / n^2,
+// keeping the strongest; x runs along rows and z down the file.
+static bool BuildFieldPool(Target * target, float * extent, std::vector<Wave> * pool)
+{
+    int n;
+    std::vector<double> re, im;
+    if(!LoadHeightField(target->field, &n, &re))
+        return false;
+    double mean = 0;
+    for(size_t i = 0; i < re.size(); ++i)
+        mean += re[i];
+    mean /= re.size();
+    for(size_t i = 0; i < re.size(); ++i)
+        re[i] -= mean;
+    im.assign(re.size(), 0);
+    for(int y = 0; y < n; ++y)
+        FFT(&re[y * n], &im[y * n], n, 1);
+    for(int x = 0; x < n; ++x)
+        FFT(&re[x], &im[x], n, n);
+
+    pool->clear();
+    double total = 0;
+    for(int v = 0; v < n / 2; ++v)
+    {
+        for(int u = -n / 2 + 1; u < n / 2; ++u)
+        {
+            if(v == 0 && u <= 0)
+                continue;
+            int index = v * n + (u + n) % n;
+            double amp = 2 * sqrt(re[index] * re[index] + im[index] * im[index]) / ((double)n * n);
+            float kx = 2 * WAVE_PI * u / (n * target->cell);
+            float kz = 2 * WAVE_PI * v / (n * target->cell);
+            float k = sqrtf(kx * kx + kz * kz);
+            Wave wave;
+            wave.dir.x = kx / k;
+            wave.dir.y = kz / k;
+            wave.length = 2 * WAVE_PI * WAVE_G / (k * k);
+            wave.amp = (float)amp;
+            total += 0.5 * amp * amp;
+            if(wave.amp > 0)
+                pool->push_back(wave);
+        }
+    }
+    std::stable_sort(pool->begin(), pool->end(), LargerAmp);
+    if(pool->size() > POOL_SIZE)
+        pool->resize(POOL_SIZE);
+    double kept = 0;
+    for(size_t i = 0; i < pool->size(); ++i)
+        kept += 0.5 * (*pool)[i].amp * (*pool)[i].amp;
+    target->captured = total > 0 ? kept / total : 0;
+    *extent = n * target->cell;
+    return !pool->empty();
+}
+
+static bool WriteWaves(const char * filename, const Target & target, float crestFactor,
+                       const std::vector<Wave> & waves, double height, double relative,
+                       double spectral)
+{
+    FILE * file = fopen(filename, "w");
+    if(!file)
+    {
+        fprintf(stderr, "ReefFit: cannot create %s\n", filename);
+        return false;
+    }
+    fprintf(file, "# Gerstner waves fitted by ReefFit, longest first\n");
+    if(target.field)
+        fprintf(file, "# target: height field %s, %g m cells\n", target.field, target.cell);
+    else
+        fprintf(file, "# target: %s, wind %g m/s, direction %g, spread %g\n", target.name,
+                target.wind, target.direction, target.spread);
+    fprintf(file, "# crest factor %g, height rms %.6g m (%.2f%%), spectral error %.2f%%\n",
+            crestFactor, height, relative * 100, spectral * 100);
+    fprintf(file, "# dirX dirZ length amp\n");
+    for(size_t i = 0; i < waves.size(); ++i)
+        fprintf(file, "%.8g %.8g %.8g %.8g\n", waves[i].dir.x, waves[i].dir.y, waves[i].length,
+                waves[i].amp);
+    bool ok = !ferror(file);
+    fclose(file);
+    if(!ok)
+        fprintf(stderr, "ReefFit: cannot write %s\n", filename);
+    return ok;
+}
+
+static void Usage()
+{
+    fprintf(stderr,
+            "usage: ReefFit [-spectrum pm|jonswap] [-wind m/s] [-dir degrees] [-spread s]\n"
+            "               [-gamma g] [-height field.pfm] [-cell meters] [-waves n]\n"
+            "               [-crest c] [-patch meters] [-samples n] [-passes n]\n"
+            "               [-seed n] [-threads n] -o output.waves\n"
+            "the target is a spectrum, pm with wind 1.5 m/s by default, or a PFM\n"
+            "height field in meters; up to %d waves are fitted\n", FIT_MAX_WAVES);
+}
+
+int main(int argc, char ** argv)
+{
+    Target target;
+    target.name = "pm";
+    target.wind = 1.5f;
+    target.direction = 135;
+    target.spread = 10;
+    target.gamma = 0;
+    target.field = NULL;
+    target.cell = 0.05f;
+    target.captured = 1;
+    const char * output = NULL;
+    int waveBudget = 16;
+    float crestFactor = 0.8f;
+    float patch = 0;
+    int sampleCount = 8192;
+    int passes = 1;
+    unsigned seed = 1;
+    int threads = 0;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "-spectrum") && i + 1 < argc)
+            target.name = argv[++i];
+        else if(!strcmp(argv[i], "-wind") && i + 1 < argc)
+            target.wind = (float)atof(argv[++i]);
+        else if(!strcmp(argv[i], "-dir") && i + 1 < argc)
+            target.direction = (float)atof(argv[++i]);
+        else if(!strcmp(argv[i], "-spread") && i + 1 < argc)
+            target.spread = (float)atof(argv[++i]);
+        else if(!strcmp(argv[i], "-gamma") && i + 1 < argc)
+            target.gamma = (float)atof(argv[++i]);
+        else if(!strcmp(argv[i], "-height") && i + 1 < argc)
+            target.field = argv[++i];
+        else if(!strcmp(argv[i], "-cell") && i + 1 < argc)
+            target.cell = (float)atof(argv[++i]);
+        else if(!strcmp(argv[i], "-waves") && i + 1 < argc)
+            waveBudget = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-crest") && i + 1 < argc)
+            crestFactor = (float)atof(argv[++i]);
+        else if(!strcmp(argv[i], "-patch") && i + 1 < argc)
+            patch = (float)atof(argv[++i]);
+        else if(!strcmp(argv[i], "-samples") && i + 1 < argc)
+            sampleCount = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-passes") && i + 1 < argc)
+            passes = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-seed") && i + 1 < argc)
+            seed = (unsigned)atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else
+        {
+            Usage();
+            return 2;
+        }
+    }
+    bool jonswap = !strcmp(target.name, "jonswap");
+    if(!output || (!jonswap && strcmp(target.name, "pm")) || waveBudget < 1
+       || waveBudget > FIT_MAX_WAVES || !(target.wind > 0) || !(target.cell > 0)
+       || target.spread < 0 || sampleCount < FIT_BLOCK || passes < 0)
+    {
+        Usage();
+        return 2;
+    }
+    // Pierson-Moskowitz has no peak enhancement, whatever -gamma said
+    if(!jonswap)
+        target.gamma = 0;
+    else if(!(target.gamma > 0))
+        target.gamma = 3.3f;
+
+    FitContext context;
+    context.crestFactor = crestFactor;
+    context.excluded = NULL;
+    float extent = 0;
+    if(target.field)
+    {
+        if(!BuildFieldPool(&target, &extent, &context.pool))
+            return 1;
+    }
+    else
+        BuildSpectrumPool(target, &context.pool);
+    if(patch <= 0)
+    {
+        // a few of the longest waves, or the whole measured field
+        float longest = 0;
+        for(size_t i = 0; i < context.pool.size(); ++i)
+        {
+            float period = 2 * WAVE_PI / WaveNumber(context.pool[i].length);
+            longest = period > longest ? period : longest;
+        }
+        patch = extent > 0 ? extent : 4 * longest;
+    }
+
+    // random points and times rather than a grid, which would alias the
+    // shortest waves; one second covers a full period of every wave. The
+    // patch sits well away from the origin, where all waves are in phase.
+    float center = PATCH_OFFSET * patch;
+    context.samples.resize(sampleCount);
+    for(int i = 0; i < sampleCount; ++i)
+    {
+        float r[3];
+        for(int c = 0; c < 3; ++c)
+        {
+            seed = seed * 1664525 + 1013904223;
+            r[c] = (seed >> 8) * (1.0f / 16777216);
+        }
+        context.samples[i].x = center + (r[0] - 0.5f) * patch;
+        context.samples[i].z = center + (r[1] - 0.5f) * patch;
+        context.samples[i].time = r[2];
+    }
+    context.reference.resize(sampleCount);
+    context.residual.resize(sampleCount);
+
+    InitJobs(threads);
+    double start = GetSeconds();
+    ParallelFor(sampleCount, 0, EvaluateReference, &context);
+    double referenceHeight, referenceSurface;
+    MeasureError(context.reference, &referenceHeight, &referenceSurface);
+    context.referenceEnergy = referenceHeight * referenceHeight * sampleCount;
+    ParallelFor(sampleCount, 0, EvaluateResidual, &context);
+
+    if(target.field)
+        printf("ReefFit: %s, %d reference waves holding %.1f%% of the energy\n", target.field,
+               (int)context.pool.size(), target.captured * 100);
+    else
+        printf("ReefFit: %s, wind %g m/s, direction %g, spread %g, gamma %g, %d reference waves\n",
+               target.name, target.wind, target.direction, target.spread,
+               jonswap ? target.gamma : 1, (int)context.pool.size());
+    printf("ReefFit: %.2f m patch, %d samples, crest factor %g, reference height rms %.6g m, "
+           "%d threads\n", patch, sampleCount, crestFactor, referenceHeight, GetJobWorkerCount());
+    printf("ReefFit: waves  height rms   height   surface rms  spectrum  seconds\n");
+
+    double height = 0, surface = 0, spectral = 0;
+    while((int)context.waves.size() < waveBudget)
+    {
+        if(!AddWave(&context))
+        {
+            printf("ReefFit: no wave lowers the error any further\n");
+            break;
+        }
+        for(int pass = 0; pass < passes; ++pass)
+        {
+            // moving one wave scales the others' share of the crest factor
+            context.waveCrest = crestFactor / context.waves.size();
+            for(size_t w = 0; w < context.waves.size(); ++w)
+                RefineWave(&context, (int)w);
+        }
+        MeasureError(context.residual, &height, &surface);
+        spectral = SpectralError(context.pool, context.waves);
+        printf("ReefFit: %5d  %10.6f  %6.2f%%  %11.6f  %7.2f%%  %7.2f\n", (int)context.waves.size(),
+               height, height / referenceHeight * 100, surface, spectral * 100,
+               GetSeconds() - start);
+    }
+    if(context.waves.empty())
+    {
+        ShutdownJobs();
+        return 1;
+    }
+
+    SortWavesByLength(&context.waves[0], (int)context.waves.size());
+    if(!WriteWaves(output, target, crestFactor, context.waves, height, height / referenceHeight,
+                   spectral))
+    {
+        ShutdownJobs();
+        return 1;
+    }
+
+    // read the file back the way the scene does and check it
+    Wave loaded[FIT_MAX_WAVES];
+    int loadedCount = LoadWaves(output, loaded, FIT_MAX_WAVES);
+    bool ok = loadedCount == (int)context.waves.size();
+    if(ok)
+    {
+        context.waves.assign(loaded, loaded + loadedCount);
+        ParallelFor(sampleCount, 0, EvaluateResidual, &context);
+        double loadedHeight, loadedSurface;
+        MeasureError(context.residual, &loadedHeight, &loadedSurface);
+        printf("ReefFit: wrote %d waves to %s, reloaded height rms %.6f\n", loadedCount, output,
+               loadedHeight);
+    }
+    else
+        fprintf(stderr, "ReefFit: %s does not read back\n", output);
+    ShutdownJobs();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,1356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "Jobs.h"
+#include "ToolFiles.h"
+
+#include <emmintrin.h>
+#include <vector>
+
+// Offline cubemap encoder for the skybox: reads a DDS cube or six face
+// images, builds box-filtered mips and writes a BC1, BC7 or BC6H cube with a
+// DX10 header. BC7 uses mode 6 and BC6H mode 11 only, one endpoint pair per
+// block, which keeps the encoder simple and is enough for smooth sky content.
+
+#define DDS_MAGIC 0x20534444
+#define DDS_FOURCC(a, b, c, d) ((unsigned)(a) | ((unsigned)(b) << 8) | ((unsigned)(c) << 16) | ((unsigned)(d) << 24))
+#define DDSD_CAPS 0x1
+#define DDSD_HEIGHT 0x2
+#define DDSD_WIDTH 0x4
+#define DDSD_PIXELFORMAT 0x1000
+#define DDSD_MIPMAPCOUNT 0x20000
+#define DDSD_LINEARSIZE 0x80000
+#define DDPF_ALPHAPIXELS 0x1
+#define DDPF_FOURCC 0x4
+#define DDPF_RGB 0x40
+#define DDSCAPS_COMPLEX 0x8
+#define DDSCAPS_TEXTURE 0x1000
+#define DDSCAPS_MIPMAP 0x400000
+#define DDSCAPS2_CUBEMAP 0x200
+#define DDSCAPS2_CUBEMAP_ALLFACES 0xFC00
+#define DDS_DIMENSION_TEXTURE2D 3
+#define DDS_RESOURCE_MISC_TEXTURECUBE 0x4
+
+#define DXGI_FORMAT_R32G32B32A32_FLOAT 2
+#define DXGI_FORMAT_R16G16B16A16_FLOAT 10
+#define DXGI_FORMAT_R8G8B8A8_UNORM 28
+#define DXGI_FORMAT_R8G8B8A8_UNORM_SRGB 29
+#define DXGI_FORMAT_BC1_UNORM 71
+#define DXGI_FORMAT_BC1_UNORM_SRGB 72
+#define DXGI_FORMAT_B8G8R8A8_UNORM 87
+#define DXGI_FORMAT_B8G8R8A8_UNORM_SRGB 91
+#define DXGI_FORMAT_BC6H_UF16 95
+#define DXGI_FORMAT_BC7_UNORM 98
+#define DXGI_FORMAT_BC7_UNORM_SRGB 99
+
+#define FACES 6
+#define MAX_LEVELS 16
+
+struct DDSPixelFormat
+{
+    unsigned size;
+    unsigned flags;
+    unsigned fourCC;
+    unsigned rgbBitCount;
+    unsigned rMask;
+    unsigned gMask;
+    unsigned bMask;
+    unsigned aMask;
+};
+
+struct DDSHeader
+{
+    unsigned size;
+    unsigned flags;
+    unsigned height;
+    unsigned width;
+    unsigned pitchOrLinearSize;
+    unsigned depth;
+    unsigned mipMapCount;
+    unsigned reserved1[11];
+    DDSPixelFormat pixelFormat;
+    unsigned caps;
+    unsigned caps2;
+    unsigned caps3;
+    unsigned caps4;
+    unsigned reserved2;
+};
+
+struct DDSHeaderDX10
+{
+    unsigned dxgiFormat;
+    unsigned resourceDimension;
+    unsigned miscFlag;
+    unsigned arraySize;
+    unsigned miscFlags2;
+};
+
+// RGBA floats: [0, 1] for LDR sources, linear radiance for HDR ones
+struct Image
+{
+    int size;
+    std::vector<float> pixels;
+};
+
+struct Cube
+{
+    int levels;
+    bool hdr;
+    bool srgb;
+    size_t sourceBytes;
+    Image faces[FACES][MAX_LEVELS];
+};
+
+enum Quality
+{
+    QUALITY_FAST,
+    QUALITY_NORMAL,
+    QUALITY_HIGH
+};
+
+// quantized endpoint pair; pbit is only used by BC7
+struct Endpoints
+{
+    int q[2][4];
+    int pbit[2];
+};
+
+// Every format is a single line segment through color space with its own
+// quantization, palette rounding and bit layout. Blocks are fitted in the
+// format's own integer domain: 0..255 for BC1 and BC7 and the 16 bit
+// unquantized half domain for BC6H, so palette errors are measured where
+// the hardware interpolates.
+struct Codec
+{
+    const char * name;
+    int blockBytes;
+    int channels;
+    int indexCount;
+    float range;
+    int qmax[4];
+    int pbitCombos;
+    const float * weights;
+    unsigned format;
+    unsigned formatSrgb;
+    void (*quantize)(const float e[2][4], int pbits, Endpoints * endpoints);
+    void (*palette)(const Endpoints & endpoints, float palette[16][4]);
+    void (*pack)(const Endpoints & endpoints, unsigned char * indices, unsigned char * block);
+    void (*decode)(const unsigned char * block, float pixels[16][4]);
+};
+
+static const int bcWeights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+static const float bc1Weights[4] = { 0, 1, 1.0f / 3, 2.0f / 3 };
+static float bc4BitWeights[16];
+
+static int Clamp(int v, int lo, int hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static float Clampf(float v, float lo, float hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static unsigned short FloatToHalf(float f)
+{
+    union { float f; unsigned u; } v;
+    v.f = f;
+    unsigned sign = (v.u >> 16) & 0x8000;
+    unsigned exponent = (v.u >> 23) & 0xff;
+    unsigned mantissa = v.u & 0x7fffff;
+    if(exponent == 0xff)
+        return (unsigned short)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    int e = (int)exponent - 127 + 15;
+    if(e >= 31)
+        return (unsigned short)(sign | 0x7c00);
+    if(e <= 0)
+    {
+        if(e < -10)
+            return (unsigned short)sign;
+        mantissa |= 0x800000;
+        int shift = 14 - e;
+        unsigned h = mantissa >> shift;
+        unsigned rest = mantissa & ((1u << shift) - 1);
+        unsigned half = 1u << (shift - 1);
+        if(rest > half || (rest == half && (h & 1)))
+            ++h;
+        return (unsigned short)(sign | h);
+    }
+    unsigned h = sign | (e << 10) | (mantissa >> 13);
+    unsigned rest = mantissa & 0x1fff;
+    if(rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        ++h;
+    return (unsigned short)h;
+}
+
+static float HalfToFloat(unsigned short h)
+{
+    unsigned sign = (h & 0x8000) << 16;
+    unsigned exponent = (h >> 10) & 0x1f;
+    unsigned mantissa = h & 0x3ff;
+    union { float f; unsigned u; } v;
+    if(!exponent)
+    {
+        float f = mantissa / 16777216.0f;
+        return sign ? -f : f;
+    }
+    if(exponent == 31)
+        v.u = sign | 0x7f800000 | (mantissa << 13);
+    else
+        v.u = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    return v.f;
+}
+
+static float SrgbToLinear(float c)
+{
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static float LinearToSrgb(float c)
+{
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+}
+
+static void PutBits(unsigned char * block, int * pos, unsigned value, int bits)
+{
+    for(int i = 0; i < bits; ++i, ++*pos)
+        if((value >> i) & 1)
+            block[*pos >> 3] |= (unsigned char)(1 << (*pos & 7));
+}
+
+static unsigned GetBits(const unsigned char * block, int * pos, int bits)
+{
+    unsigned value = 0;
+    for(int i = 0; i < bits; ++i, ++*pos)
+        value |= ((block[*pos >> 3] >> (*pos & 7)) & 1u) << i;
+    return value;
+}
+
+// BC1: 5:6:5 endpoints, always in four color mode
+
+static const int bc1Bits[3] = { 5, 6, 5 };
+
+static int Expand565(int q, int bits)
+{
+    return (q << (8 - bits)) | (q >> (2 * bits - 8));
+}
+
+static void QuantizeBC1(const float e[2][4], int, Endpoints * endpoints)
+{
+    for(int i = 0; i < 2; ++i)
+    {
+        for(int c = 0; c < 3; ++c)
+        {
+            int qmax = (1 << bc1Bits[c]) - 1;
+            endpoints->q[i][c] = Clamp((int)floorf(e[i][c] * qmax / 255 + 0.5f), 0, qmax);
+        }
+        endpoints->q[i][3] = 0;
+        endpoints->pbit[i] = 0;
+    }
+}
+
+static void PaletteBC1(const Endpoints & endpoints, float palette[16][4])
+{
+    for(int c = 0; c < 3; ++c)
+    {
+        int a = Expand565(endpoints.q[0][c], bc1Bits[c]);
+        int b = Expand565(endpoints.q[1][c], bc1Bits[c]);
+        palette[0][c] = (float)a;
+        palette[1][c] = (float)b;
+        palette[2][c] = (float)((2 * a + b) / 3);
+        palette[3][c] = (float)((a + 2 * b) / 3);
+    }
+    for(int i = 0; i < 4; ++i)
+        palette[i][3] = 0;
+}
+
+static int Pack565(const int * q)
+{
+    return (q[0] << 11) | (q[1] << 5) | q[2];
+}
+
+static void PackBC1(const Endpoints & endpoints, unsigned char * indices, unsigned char * block)
+{
+    int c0 = Pack565(endpoints.q[0]);
+    int c1 = Pack565(endpoints.q[1]);
+    if(c0 < c1)
+    {
+        // four color mode needs c0 > c1
+        int tmp = c0;
+        c0 = c1;
+        c1 = tmp;
+        for(int i = 0; i < 16; ++i)
+            indices[i] ^= 1;
+    }
+    else if(c0 == c1)
+        memset(indices, 0, 16);
+    memset(block, 0, 8);
+    int pos = 0;
+    PutBits(block, &pos, c0, 16);
+    PutBits(block, &pos, c1, 16);
+    for(int i = 0; i < 16; ++i)
+        PutBits(block, &pos, indices[i], 2);
+}
+
+static void DecodeBC1(const unsigned char * block, float pixels[16][4])
+{
+    int pos = 0;
+    int c[2];
+    c[0] = GetBits(block, &pos, 16);
+    c[1] = GetBits(block, &pos, 16);
+    float palette[4][3];
+    for(int i = 0; i < 2; ++i)
+    {
+        palette[i][0] = (float)Expand565((c[i] >> 11) & 31, 5);
+        palette[i][1] = (float)Expand565((c[i] >> 5) & 63, 6);
+        palette[i][2] = (float)Expand565(c[i] & 31, 5);
+    }
+    for(int k = 0; k < 3; ++k)
+    {
+        int a = (int)palette[0][k], b = (int)palette[1][k];
+        if(c[0] > c[1])
+        {
+            palette[2][k] = (float)((2 * a + b) / 3);
+            palette[3][k] = (float)((a + 2 * b) / 3);
+        }
+        else
+        {
+            palette[2][k] = (float)((a + b) / 2);
+            palette[3][k] = 0;
+        }
+    }
+    for(int i = 0; i < 16; ++i)
+    {
+        int index = GetBits(block, &pos, 2);
+        for(int k = 0; k < 3; ++k)
+            pixels[i][k] = palette[index][k] / 255;
+        pixels[i][3] = 1;
+    }
+}
+
+// BC7 mode 6: 7.7.7.7 endpoints with a shared LSB per endpoint, 4 bit indices
+
+static int QuantizeBC7Channel(float v, int pbit)
+{
+    return Clamp((int)floorf((v - pbit) / 2 + 0.5f), 0, 127);
+}
+
+static void QuantizeBC7(const float e[2][4], int pbits, Endpoints * endpoints)
+{
+    for(int i = 0; i < 2; ++i)
+    {
+        int pbit;
+        if(pbits >= 0)
+            pbit = (pbits >> i) & 1;
+        else
+        {
+            // the shared bit that loses the least to quantization
+            float error[2] = { 0, 0 };
+            for(int p = 0; p < 2; ++p)
+            {
+                for(int c = 0; c < 4; ++c)
+                {
+                    float d = e[i][c] - (QuantizeBC7Channel(e[i][c], p) * 2 + p);
+                    error[p] += d * d;
+                }
+            }
+            pbit = error[1] < error[0];
+        }
+        endpoints->pbit[i] = pbit;
+        for(int c = 0; c < 4; ++c)
+            endpoints->q[i][c] = QuantizeBC7Channel(e[i][c], pbit);
+    }
+}
+
+static void PaletteBC7(const Endpoints & endpoints, float palette[16][4])
+{
+    for(int c = 0; c < 4; ++c)
+    {
+        int a = endpoints.q[0][c] * 2 + endpoints.pbit[0];
+        int b = endpoints.q[1][c] * 2 + endpoints.pbit[1];
+        for(int i = 0; i < 16; ++i)
+            palette[i][c] = (float)((a * (64 - bcWeights4[i]) + b * bcWeights4[i] + 32) >> 6);
+    }
+}
+
+static void PackBC7(const Endpoints & endpoints, unsigned char * indices, unsigned char * block)
+{
+    int first = 0, second = 1;
+    if(indices[0] & 8)
+    {
+        // the anchor index is stored without its top bit
+        first = 1;
+        second = 0;
+        for(int i = 0; i < 16; ++i)
+            indices[i] = (unsigned char)(15 - indices[i]);
+    }
+    memset(block, 0, 16);
+    int pos = 0;
+    PutBits(block, &pos, 1 << 6, 7);
+    for(int c = 0; c < 4; ++c)
+    {
+        PutBits(block, &pos, endpoints.q[first][c], 7);
+        PutBits(block, &pos, endpoints.q[second][c], 7);
+    }
+    PutBits(block, &pos, endpoints.pbit[first], 1);
+    PutBits(block, &pos, endpoints.pbit[second], 1);
+    PutBits(block, &pos, indices[0], 3);
+    for(int i = 1; i < 16; ++i)
+        PutBits(block, &pos, indices[i], 4);
+}
+
+static void DecodeBC7(const unsigned char * block, float pixels[16][4])
+{
+    int pos = 0;
+    if(GetBits(block, &pos, 7) != 1 << 6)
+    {
+        // only mode 6 is written here
+        memset(pixels, 0, 16 * 4 * sizeof(float));
+        return;
+    }
+    int e[2][4];
+    for(int c = 0; c < 4; ++c)
+    {
+        e[0][c] = GetBits(block, &pos, 7) << 1;
+        e[1][c] = GetBits(block, &pos, 7) << 1;
+    }
+    int p0 = GetBits(block, &pos, 1);
+    int p1 = GetBits(block, &pos, 1);
+    for(int c = 0; c < 4; ++c)
+    {
+        e[0][c] |= p0;
+        e[1][c] |= p1;
+    }
+    for(int i = 0; i < 16; ++i)
+    {
+        int w = bcWeights4[GetBits(block, &pos, i ? 4 : 3)];
+        for(int c = 0; c < 4; ++c)
+            pixels[i][c] = ((e[0][c] * (64 - w) + e[1][c] * w + 32) >> 6) / 255.0f;
+    }
+}
+
+// BC6H mode 11: unsigned 10 bit endpoints without deltas, 4 bit indices.
+// The hardware interpolates in a 16 bit domain that maps linearly onto the
+// half bit pattern, so the fit is roughly logarithmic in radiance.
+
+static int UnquantizeBC6H(int q)
+{
+    if(q == 0)
+        return 0;
+    if(q == 1023)
+        return 0xffff;
+    return ((q << 16) + 0x8000) >> 10;
+}
+
+static float BC6HDomain(float f)
+{
+    int h = FloatToHalf(f > 0 ? f : 0);
+    if(h > 0x7bff)
+        h = 0x7bff;
+    return h * 64.0f / 31;
+}
+
+// inverse of UnquantizeBC6H: u = 64 * q + 32, rounded to the nearest q
+static void QuantizeBC6H(const float e[2][4], int, Endpoints * endpoints)
+{
+    for(int i = 0; i < 2; ++i)
+    {
+        for(int c = 0; c < 3; ++c)
+            endpoints->q[i][c] = Clamp((int)floorf(e[i][c] / 64), 0, 1023);
+        endpoints->q[i][3] = 0;
+        endpoints->pbit[i] = 0;
+    }
+}
+
+static void PaletteBC6H(const Endpoints & endpoints, float palette[16][4])
+{
+    for(int c = 0; c < 3; ++c)
+    {
+        int a = UnquantizeBC6H(endpoints.q[0][c]);
+        int b = UnquantizeBC6H(endpoints.q[1][c]);
+        for(int i = 0; i < 16; ++i)
+            palette[i][c] = (float)((a * (64 - bcWeights4[i]) + b * bcWeights4[i] + 32) >> 6);
+    }
+    for(int i = 0; i < 16; ++i)
+        palette[i][3] = 0;
+}
+
+static void PackBC6H(const Endpoints & endpoints, unsigned char * indices, unsigned char * block)
+{
+    int first = 0, second = 1;
+    if(indices[0] & 8)
+    {
+        first = 1;
+        second = 0;
+        for(int i = 0; i < 16; ++i)
+            indices[i] = (unsigned char)(15 - indices[i]);
+    }
+    memset(block, 0, 16);
+    int pos = 0;
+    PutBits(block, &pos, 3, 5);
+    for(int c = 0; c < 3; ++c)
+        PutBits(block, &pos, endpoints.q[first][c], 10);
+    for(int c = 0; c < 3; ++c)
+        PutBits(block, &pos, endpoints.q[second][c], 10);
+    PutBits(block, &pos, indices[0], 3);
+    for(int i = 1; i < 16; ++i)
+        PutBits(block, &pos, indices[i], 4);
+}
+
+static void DecodeBC6H(const unsigned char * block, float pixels[16][4])
+{
+    int pos = 0;
+    if(GetBits(block, &pos, 5) != 3)
+    {
+        // only mode 11 is written here
+        memset(pixels, 0, 16 * 4 * sizeof(float));
+        return;
+    }
+    int e[2][3];
+    for(int i = 0; i < 2; ++i)
+        for(int c = 0; c < 3; ++c)
+            e[i][c] = UnquantizeBC6H(GetBits(block, &pos, 10));
+    for(int i = 0; i < 16; ++i)
+    {
+        int w = bcWeights4[GetBits(block, &pos, i ? 4 : 3)];
+        for(int c = 0; c < 3; ++c)
+        {
+            int v = (e[0][c] * (64 - w) + e[1][c] * w + 32) >> 6;
+            pixels[i][c] = HalfToFloat((unsigned short)((v * 31) >> 6));
+        }
+        pixels[i][3] = 1;
+    }
+}
+
+static const Codec codecs[] =
+{
+    { "bc1", 8, 3, 4, 255, { 31, 63, 31, 0 }, 1, bc1Weights,
+      DXGI_FORMAT_BC1_UNORM, DXGI_FORMAT_BC1_UNORM_SRGB,
+      QuantizeBC1, PaletteBC1, PackBC1, DecodeBC1 },
+    { "bc7", 16, 4, 16, 255, { 127, 127, 127, 127 }, 4, bc4BitWeights,
+      DXGI_FORMAT_BC7_UNORM, DXGI_FORMAT_BC7_UNORM_SRGB,
+      QuantizeBC7, PaletteBC7, PackBC7, DecodeBC7 },
+    { "bc6h", 16, 3, 16, 65535, { 1023, 1023, 1023, 0 }, 1, bc4BitWeights,
+      DXGI_FORMAT_BC6H_UF16, DXGI_FORMAT_BC6H_UF16,
+      QuantizeBC6H, PaletteBC6H, PackBC6H, DecodeBC6H }
+};
+
+// 16 pixels stored channel by channel, in the codec's domain
+struct Block
+{
+    float c[4][16];
+};
+
+// Picks the nearest palette entry for every pixel, four pixels at a time.
+static float FitIndices(const Block & block, int channels, const float palette[16][4],
+                        int paletteSize, unsigned char * indices)
+{
+    __m128 total = _mm_setzero_ps();
+    for(int g = 0; g < 16; g += 4)
+    {
+        __m128 px[4];
+        for(int c = 0; c < channels; ++c)
+            px[c] = _mm_loadu_ps(block.c[c] + g);
+        __m128 best = _mm_set1_ps(1e30f);
+        __m128 bestIndex = _mm_setzero_ps();
+        for(int p = 0; p < paletteSize; ++p)
+        {
+            __m128 d = _mm_sub_ps(px[0], _mm_set1_ps(palette[p][0]));
+            __m128 error = _mm_mul_ps(d, d);
+            for(int c = 1; c < channels; ++c)
+            {
+                d = _mm_sub_ps(px[c], _mm_set1_ps(palette[p][c]));
+                error = _mm_add_ps(error, _mm_mul_ps(d, d));
+            }
+            __m128 closer = _mm_cmplt_ps(error, best);
+            best = _mm_min_ps(error, best);
+            bestIndex = _mm_or_ps(_mm_and_ps(closer, _mm_set1_ps((float)p)),
+                                  _mm_andnot_ps(closer, bestIndex));
+        }
+        total = _mm_add_ps(total, best);
+        __m128i index = _mm_cvttps_epi32(bestIndex);
+        int lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, index);
+        for(int l = 0; l < 4; ++l)
+            indices[g + l] = (unsigned char)lanes[l];
+    }
+    float sums[4];
+    _mm_storeu_ps(sums, total);
+    return sums[0] + sums[1] + sums[2] + sums[3];
+}
+
+static float EvaluateEndpoints(const Codec & codec, const Block & block, const Endpoints & endpoints,
+                               unsigned char * indices)
+{
+    float palette[16][4];
+    codec.palette(endpoints, palette);
+    return FitIndices(block, codec.channels, palette, codec.indexCount, indices);
+}
+
+// endpoints at the extremes of the block's projection onto its principal axis
+static void PrincipalEndpoints(const Block & block, int channels, float range, float e[2][4])
+{
+    float mean[4] = { 0, 0, 0, 0 };
+    for(int c = 0; c < channels; ++c)
+    {
+        for(int i = 0; i < 16; ++i)
+            mean[c] += block.c[c][i];
+        mean[c] /= 16;
+    }
+    float cov[4][4] = { { 0 } };
+    for(int i = 0; i < 16; ++i)
+        for(int a = 0; a < channels; ++a)
+            for(int b = 0; b < channels; ++b)
+                cov[a][b] += (block.c[a][i] - mean[a]) * (block.c[b][i] - mean[b]);
+
+    float axis[4] = { 1, 1, 1, 1 };
+    for(int iteration = 0; iteration < 8; ++iteration)
+    {
+        float next[4] = { 0, 0, 0, 0 };
+        float length = 0;
+        for(int a = 0; a < channels; ++a)
+        {
+            for(int b = 0; b < channels; ++b)
+                next[a] += cov[a][b] * axis[b];
+            length = fabsf(next[a]) > length ? fabsf(next[a]) : length;
+        }
+        if(length == 0)
+            break;
+        for(int a = 0; a < channels; ++a)
+            axis[a] = next[a] / length;
+    }
+    float norm = 0;
+    for(int c = 0; c < channels; ++c)
+        norm += axis[c] * axis[c];
+    float lo = 0, hi = 0;
+    if(norm > 0)
+    {
+        norm = 1 / sqrtf(norm);
+        for(int c = 0; c < channels; ++c)
+            axis[c] *= norm;
+        lo = 1e30f;
+        hi = -1e30f;
+        for(int i = 0; i < 16; ++i)
+        {
+            float t = 0;
+            for(int c = 0; c < channels; ++c)
+                t += (block.c[c][i] - mean[c]) * axis[c];
+            lo = t < lo ? t : lo;
+            hi = t > hi ? t : hi;
+        }
+    }
+    for(int c = 0; c < 4; ++c)
+    {
+        e[0][c] = c < channels ? Clampf(mean[c] + lo * axis[c], 0, range) : 0;
+        e[1][c] = c < channels ? Clampf(mean[c] + hi * axis[c], 0, range) : 0;
+    }
+}
+
+// least squares endpoints for the given index assignment
+static bool RefineEndpoints(const Codec & codec, const Block & block, const unsigned char * indices,
+                            float e[2][4])
+{
+    float aa = 0, ab = 0, bb = 0;
+    float ax[4] = { 0, 0, 0, 0 }, bx[4] = { 0, 0, 0, 0 };
+    for(int i = 0; i < 16; ++i)
+    {
+        float t = codec.weights[indices[i]];
+        float s = 1 - t;
+        aa += s * s;
+        ab += s * t;
+        bb += t * t;
+        for(int c = 0; c < codec.channels; ++c)
+        {
+            ax[c] += s * block.c[c][i];
+            bx[c] += t * block.c[c][i];
+        }
+    }
+    float det = aa * bb - ab * ab;
+    if(fabsf(det) < 1e-6f)
+        return false;
+    for(int c = 0; c < codec.channels; ++c)
+    {
+        e[0][c] = Clampf((bb * ax[c] - ab * bx[c]) / det, 0, codec.range);
+        e[1][c] = Clampf((aa * bx[c] - ab * ax[c]) / det, 0, codec.range);
+    }
+    return true;
+}
+
+static void EncodeBlock(const Codec & codec, const Block & block, Quality quality, unsigned char * output)
+{
+    float e[2][4];
+    PrincipalEndpoints(block, codec.channels, codec.range, e);
+
+    Endpoints best;
+    unsigned char bestIndices[16];
+    float bestError = 1e30f;
+    int combos = quality == QUALITY_HIGH ? codec.pbitCombos : 1;
+    int refinements = quality == QUALITY_FAST ? 0 : quality == QUALITY_NORMAL ? 2 : 4;
+    for(int combo = 0; combo < combos; ++combo)
+    {
+        int pbits = combos > 1 ? combo : -1;
+        float fit[2][4];
+        memcpy(fit, e, sizeof(fit));
+        for(int r = 0; r <= refinements; ++r)
+        {
+            Endpoints candidate;
+            unsigned char indices[16];
+            codec.quantize(fit, pbits, &candidate);
+            float error = EvaluateEndpoints(codec, block, candidate, indices);
+            if(error < bestError)
+            {
+                bestError = error;
+                best = candidate;
+                memcpy(bestIndices, indices, 16);
+            }
+            if(r == refinements || !RefineEndpoints(codec, block, indices, fit))
+                break;
+        }
+    }
+
+    if(quality == QUALITY_HIGH)
+    {
+        // greedy one step moves of every quantized endpoint channel
+        for(int iteration = 0; iteration < 8 && bestError > 0; ++iteration)
+        {
+            bool improved = false;
+            for(int i = 0; i < 2; ++i)
+            {
+                for(int c = 0; c < codec.channels; ++c)
+                {
+                    for(int step = -1; step <= 1; step += 2)
+                    {
+                        Endpoints candidate = best;
+                        int q = candidate.q[i][c] + step;
+                        if(q < 0 || q > codec.qmax[c])
+                            continue;
+                        candidate.q[i][c] = q;
+                        unsigned char indices[16];
+                        float error = EvaluateEndpoints(codec, block, candidate, indices);
+                        if(error < bestError)
+                        {
+                            bestError = error;
+                            best = candidate;
+                            memcpy(bestIndices, indices, 16);
+                            improved = true;
+                        }
+                    }
+                }
+            }
+            if(!improved)
+                break;
+        }
+    }
+    codec.pack(best, bestIndices, output);
+}
+
+static int LevelBlocks(int size)
+{
+    return (size + 3) / 4;
+}
+
+// pixels past the edge of mips smaller than a block repeat the last ones
+static void LoadBlock(const Codec & codec, const Image & image, int bx, int by, Block * block)
+{
+    for(int y = 0; y < 4; ++y)
+    {
+        int sy = by * 4 + y < image.size ? by * 4 + y : image.size - 1;
+        for(int x = 0; x < 4; ++x)
+        {
+            int sx = bx * 4 + x < image.size ? bx * 4 + x : image.size - 1;
+            const float * p = &image.pixels[(sy * image.size + sx) * 4];
+            for(int c = 0; c < 4; ++c)
+            {
+                float v = p[c];
+                if(codec.range > 255)
+                    v = BC6HDomain(v);
+                else
+                    v = Clampf(v, 0, 1) * 255;
+                block->c[c][y * 4 + x] = v;
+            }
+        }
+    }
+}
+
+struct Region
+{
+    int face;
+    int level;
+    int firstBlock;
+    size_t offset;
+    double squaredError;
+    double samples;
+};
+
+struct EncodeContext
+{
+    const Codec * codec;
+    const Cube * cube;
+    Quality quality;
+    std::vector<Region> regions;
+    std::vector<unsigned char> data;
+};
+
+static int FindRegion(const EncodeContext * context, int block)
+{
+    int r = 0;
+    while(r + 1 < (int)context->regions.size() && context->regions[r + 1].firstBlock <= block)
+        ++r;
+    return r;
+}
+
+static void EncodeBlocks(void * data, int begin, int end)
+{
+    EncodeContext * context = (EncodeContext*)data;
+    const Codec & codec = *context->codec;
+    int r = FindRegion(context, begin);
+    for(int b = begin; b < end; ++b)
+    {
+        if(r + 1 < (int)context->regions.size() && context->regions[r + 1].firstBlock <= b)
+            ++r;
+        const Region & region = context->regions[r];
+        const Image & image = context->cube->faces[region.face][region.level];
+        int blocksX = LevelBlocks(image.size);
+        int local = b - region.firstBlock;
+        Block block;
+        LoadBlock(codec, image, local % blocksX, local / blocksX, &block);
+        EncodeBlock(codec, block, context->quality,
+                    &context->data[region.offset + (size_t)local * codec.blockBytes]);
+    }
+}
+
+// LDR error is measured on 8 bit values; HDR error is the mean over exposures
+// from -4 to +4 stops of the error after a gamma 2.2 tone map (mPSNR)
+static double ToneMap(float v, float exposure)
+{
+    double t = pow(exposure * (v > 0 ? v : 0), 1 / 2.2) * 255;
+    return t < 255 ? t : 255;
+}
+
+static void MeasureRegions(void * data, int begin, int end)
+{
+    EncodeContext * context = (EncodeContext*)data;
+    const Codec & codec = *context->codec;
+    bool hdr = codec.range > 255;
+    for(int r = begin; r < end; ++r)
+    {
+        Region & region = context->regions[r];
+        const Image & image = context->cube->faces[region.face][region.level];
+        int blocksX = LevelBlocks(image.size);
+        double error = 0, samples = 0;
+        for(int b = 0; b < blocksX * blocksX; ++b)
+        {
+            float pixels[16][4];
+            codec.decode(&context->data[region.offset + (size_t)b * codec.blockBytes], pixels);
+            for(int i = 0; i < 16; ++i)
+            {
+                int x = (b % blocksX) * 4 + i % 4;
+                int y = (b / blocksX) * 4 + i / 4;
+                if(x >= image.size || y >= image.size)
+                    continue;
+                const float * p = &image.pixels[(y * image.size + x) * 4];
+                for(int c = 0; c < 3; ++c)
+                {
+                    if(hdr)
+                    {
+                        for(int stop = -4; stop <= 4; ++stop)
+                        {
+                            float exposure = ldexpf(1, stop);
+                            double d = ToneMap(pixels[i][c], exposure) - ToneMap(p[c], exposure);
+                            error += d * d / 9;
+                        }
+                    }
+                    else
+                    {
+                        double d = (pixels[i][c] - Clampf(p[c], 0, 1)) * 255.0;
+                        error += d * d;
+                    }
+                    samples += 1;
+                }
+            }
+        }
+        region.squaredError = error;
+        region.samples = samples;
+    }
+}
+
+static double Psnr(double squaredError, double samples)
+{
+    if(squaredError <= 0)
+        return 99;
+    return 10 * log10(255.0 * 255.0 * samples / squaredError);
+}
+
+static void AllocImage(Image * image, int size)
+{
+    image->size = size;
+    image->pixels.assign((size_t)size * size * 4, 0.0f);
+}
+
+static unsigned MaskShift(unsigned mask)
+{
+    unsigned shift = 0;
+    while(mask && !(mask & 1))
+    {
+        mask >>= 1;
+        ++shift;
+    }
+    return shift;
+}
+
+static bool LoadDDS(const char * filename, Cube * cube)
+{
+    std::vector<unsigned char> data;
+    if(!ReadFile("ReefTex", filename, &data))
+        return false;
+    if(data.size() < 4 + sizeof(DDSHeader) || *(unsigned*)&data[0] != DDS_MAGIC)
+    {
+        fprintf(stderr, "ReefTex: %s is not a DDS file\n", filename);
+        return false;
+    }
+    DDSHeader header;
+    memcpy(&header, &data[4], sizeof(header));
+    size_t offset = 4 + sizeof(DDSHeader);
+    unsigned format = 0;
+    bool cubeFlag = (header.caps2 & DDSCAPS2_CUBEMAP)
+                    && (header.caps2 & DDSCAPS2_CUBEMAP_ALLFACES) == DDSCAPS2_CUBEMAP_ALLFACES;
+    const DDSPixelFormat & pf = header.pixelFormat;
+    unsigned masks[4] = { 0xff, 0xff00, 0xff0000, 0xff000000 };
+    if((pf.flags & DDPF_FOURCC) && pf.fourCC == DDS_FOURCC('D', 'X', '1', '0'))
+    {
+        DDSHeaderDX10 dx10;
+        if(data.size() < offset + sizeof(dx10))
+            return false;
+        memcpy(&dx10, &data[offset], sizeof(dx10));
+        offset += sizeof(dx10);
+        format = dx10.dxgiFormat;
+        cubeFlag = (dx10.miscFlag & DDS_RESOURCE_MISC_TEXTURECUBE) && dx10.arraySize == 1;
+    }
+    else if(pf.flags & DDPF_FOURCC)
+    {
+        if(pf.fourCC == 113)
+            format = DXGI_FORMAT_R16G16B16A16_FLOAT;
+        else if(pf.fourCC == 116)
+            format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+    }
+    else if((pf.flags & DDPF_RGB) && pf.rgbBitCount == 32)
+    {
+        format = DXGI_FORMAT_R8G8B8A8_UNORM;
+        masks[0] = pf.rMask;
+        masks[1] = pf.gMask;
+        masks[2] = pf.bMask;
+        masks[3] = (pf.flags & DDPF_ALPHAPIXELS) ? pf.aMask : 0;
+    }
+    if(format == DXGI_FORMAT_B8G8R8A8_UNORM || format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB)
+    {
+        masks[0] = 0xff0000;
+        masks[2] = 0xff;
+    }
+
+    int bytesPerPixel;
+    switch(format)
+    {
+    case DXGI_FORMAT_R32G32B32A32_FLOAT:
+        bytesPerPixel = 16;
+        break;
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+        bytesPerPixel = 8;
+        break;
+    case DXGI_FORMAT_R8G8B8A8_UNORM:
+    case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+    case DXGI_FORMAT_B8G8R8A8_UNORM:
+    case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+        bytesPerPixel = 4;
+        break;
+    default:
+        fprintf(stderr, "ReefTex: unsupported pixel format in %s\n", filename);
+        return false;
+    }
+    if(!cubeFlag || header.width != header.height || !header.width)
+    {
+        fprintf(stderr, "ReefTex: %s is not a cube map\n", filename);
+        return false;
+    }
+
+    int size = header.width;
+    int mips = (header.flags & DDSD_MIPMAPCOUNT) && header.mipMapCount ? header.mipMapCount : 1;
+    size_t faceBytes = 0;
+    for(int level = 0, s = size; level < mips; ++level, s = s > 1 ? s / 2 : 1)
+        faceBytes += (size_t)s * s * bytesPerPixel;
+    if(data.size() < offset + faceBytes * FACES)
+    {
+        fprintf(stderr, "ReefTex: %s is truncated\n", filename);
+        return false;
+    }
+
+    cube->hdr = bytesPerPixel > 4;
+    cube->srgb = format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB || format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB;
+    cube->sourceBytes = faceBytes * FACES;
+    for(int f = 0; f < FACES; ++f)
+    {
+        // only the top level is used, the mips are rebuilt
+        const unsigned char * src = &data[offset + f * faceBytes];
+        Image & image = cube->faces[f][0];
+        AllocImage(&image, size);
+        for(int i = 0; i < size * size; ++i)
+        {
+            float * p = &image.pixels[i * 4];
+            const unsigned char * s = src + (size_t)i * bytesPerPixel;
+            if(bytesPerPixel == 16)
+                memcpy(p, s, 16);
+            else if(bytesPerPixel == 8)
+            {
+                for(int c = 0; c < 4; ++c)
+                    p[c] = HalfToFloat((unsigned short)(s[c * 2] | (s[c * 2 + 1] << 8)));
+            }
+            else
+            {
+                unsigned v = s[0] | (s[1] << 8) | (s[2] << 16) | ((unsigned)s[3] << 24);
+                for(int c = 0; c < 4; ++c)
+                    p[c] = masks[c] ? ((v & masks[c]) >> MaskShift(masks[c])) / (float)(masks[c] >> MaskShift(masks[c])) : 1;
+            }
+        }
+    }
+    return true;
+}
+
+// PFM is read as linear HDR, binary PPM as 8 or 16 bit LDR
+static bool LoadFace(const char * filename, Image * image, bool * hdr)
+{
+    std::vector<unsigned char> data;
+    if(!ReadFile("ReefTex", filename, &data))
+        return false;
+    size_t pos = 0;
+    char magic[8], w[16], h[16], scale[32];
+    if(!ReadToken(data, &pos, magic, sizeof(magic)) || !ReadToken(data, &pos, w, sizeof(w))
+       || !ReadToken(data, &pos, h, sizeof(h)) || !ReadToken(data, &pos, scale, sizeof(scale)))
+    {
+        fprintf(stderr, "ReefTex: bad header in %s\n", filename);
+        return false;
+    }
+    ++pos;
+    int width = atoi(w), height = atoi(h);
+    if(width <= 0 || width != height)
+    {
+        fprintf(stderr, "ReefTex: %s is not square\n", filename);
+        return false;
+    }
+    AllocImage(image, width);
+    size_t pixels = (size_t)width * height;
+    if(!strcmp(magic, "PF") || !strcmp(magic, "Pf"))
+    {
+        int channels = magic[1] == 'F' ? 3 : 1;
+        bool bigEndian = atof(scale) > 0;
+        if(data.size() < pos + pixels * channels * 4)
+        {
+            fprintf(stderr, "ReefTex: %s is truncated\n", filename);
+            return false;
+        }
+        for(size_t i = 0; i < pixels; ++i)
+        {
+            // rows are stored bottom to top
+            size_t y = height - 1 - i / width, x = i % width;
+            float * p = &image->pixels[(y * width + x) * 4];
+            for(int c = 0; c < 3; ++c)
+            {
+                const unsigned char * s = &data[pos + (i * channels + (channels == 3 ? c : 0)) * 4];
+                unsigned char b[4] = { s[0], s[1], s[2], s[3] };
+                if(bigEndian)
+                {
+                    b[0] = s[3];
+                    b[1] = s[2];
+                    b[2] = s[1];
+                    b[3] = s[0];
+                }
+                memcpy(&p[c], b, 4);
+            }
+            p[3] = 1;
+        }
+        *hdr = true;
+    }
+    else if(!strcmp(magic, "P6"))
+    {
+        int max = atoi(scale);
+        int bytes = max > 255 ? 2 : 1;
+        if(max <= 0 || max > 65535 || data.size() < pos + pixels * 3 * bytes)
+        {
+            fprintf(stderr, "ReefTex: %s is truncated\n", filename);
+            return false;
+        }
+        for(size_t i = 0; i < pixels; ++i)
+        {
+            float * p = &image->pixels[i * 4];
+            for(int c = 0; c < 3; ++c)
+            {
+                const unsigned char * s = &data[pos + (i * 3 + c) * bytes];
+                int v = bytes == 2 ? (s[0] << 8) | s[1] : s[0];
+                p[c] = v / (float)max;
+            }
+            p[3] = 1;
+        }
+        *hdr = false;
+    }
+    else
+    {
+        fprintf(stderr, "ReefTex: %s is neither PFM nor binary PPM\n", filename);
+        return false;
+    }
+    return true;
+}
+
+static bool LoadFaces(char ** filenames, Cube * cube)
+{
+    cube->srgb = false;
+    cube->sourceBytes = 0;
+    for(int f = 0; f < FACES; ++f)
+    {
+        bool hdr;
+        if(!LoadFace(filenames[f], &cube->faces[f][0], &hdr))
+            return false;
+        if(f && (hdr != cube->hdr || cube->faces[f][0].size != cube->faces[0][0].size))
+        {
+            fprintf(stderr, "ReefTex: %s does not match the other faces\n", filenames[f]);
+            return false;
+        }
+        cube->hdr = hdr;
+        cube->sourceBytes += cube->faces[f][0].pixels.size() * (hdr ? sizeof(float) : 1);
+    }
+    return true;
+}
+
+struct MipContext
+{
+    Cube * cube;
+    int level;
+};
+
+// 2x2 box filter, in linear space for sRGB sources
+static void BuildFaceMips(void * data, int begin, int end)
+{
+    MipContext * context = (MipContext*)data;
+    Cube * cube = context->cube;
+    for(int f = begin; f < end; ++f)
+    {
+        const Image & src = cube->faces[f][context->level - 1];
+        Image & dst = cube->faces[f][context->level];
+        AllocImage(&dst, src.size > 1 ? src.size / 2 : 1);
+        for(int y = 0; y < dst.size; ++y)
+        {
+            for(int x = 0; x < dst.size; ++x)
+            {
+                for(int c = 0; c < 4; ++c)
+                {
+                    float sum = 0;
+                    for(int k = 0; k < 4; ++k)
+                    {
+                        int sx = x * 2 + (k & 1) < src.size ? x * 2 + (k & 1) : src.size - 1;
+                        int sy = y * 2 + (k >> 1) < src.size ? y * 2 + (k >> 1) : src.size - 1;
+                        float v = src.pixels[(sy * src.size + sx) * 4 + c];
+                        sum += cube->srgb && c < 3 ? SrgbToLinear(v) : v;
+                    }
+                    sum /= 4;
+                    dst.pixels[(y * dst.size + x) * 4 + c] = cube->srgb && c < 3 ? LinearToSrgb(sum) : sum;
+                }
+            }
+        }
+    }
+}
+
+static void BuildMips(Cube * cube)
+{
+    int size = cube->faces[0][0].size;
+    cube->levels = 1;
+    while(size > 1 && cube->levels < MAX_LEVELS)
+    {
+        size /= 2;
+        MipContext context = { cube, cube->levels };
+        ParallelFor(FACES, 1, BuildFaceMips, &context);
+        ++cube->levels;
+    }
+}
+
+static bool WriteDDS(const char * filename, const Codec & codec, const Cube & cube,
+                     const std::vector<unsigned char> & data)
+{
+    DDSHeader header;
+    memset(&header, 0, sizeof(header));
+    int size = cube.faces[0][0].size;
+    header.size = sizeof(DDSHeader);
+    header.flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE;
+    header.width = size;
+    header.height = size;
+    header.pitchOrLinearSize = LevelBlocks(size) * LevelBlocks(size) * codec.blockBytes;
+    header.mipMapCount = cube.levels;
+    header.pixelFormat.size = sizeof(DDSPixelFormat);
+    header.pixelFormat.flags = DDPF_FOURCC;
+    header.pixelFormat.fourCC = DDS_FOURCC('D', 'X', '1', '0');
+    header.caps = DDSCAPS_COMPLEX | DDSCAPS_TEXTURE | DDSCAPS_MIPMAP;
+    header.caps2 = DDSCAPS2_CUBEMAP | DDSCAPS2_CUBEMAP_ALLFACES;
+
+    DDSHeaderDX10 dx10;
+    dx10.dxgiFormat = cube.srgb ? codec.formatSrgb : codec.format;
+    dx10.resourceDimension = DDS_DIMENSION_TEXTURE2D;
+    dx10.miscFlag = DDS_RESOURCE_MISC_TEXTURECUBE;
+    dx10.arraySize = 1;
+    dx10.miscFlags2 = 0;
+
+    FILE * file = fopen(filename, "wb");
+    if(!file)
+    {
+        fprintf(stderr, "ReefTex: unable to create %s\n", filename);
+        return false;
+    }
+    unsigned magic = DDS_MAGIC;
+    bool ok = fwrite(&magic, 4, 1, file) == 1
+              && fwrite(&header, sizeof(header), 1, file) == 1
+              && fwrite(&dx10, sizeof(dx10), 1, file) == 1
+              && fwrite(&data[0], 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+    if(!ok)
+        fprintf(stderr, "ReefTex: unable to write %s\n", filename);
+    return ok;
+}
+
+static void Usage()
+{
+    fprintf(stderr,
+            "usage: ReefTex [-format bc1|bc7|bc6h] [-quality fast|normal|high] [-srgb]\n"
+            "               [-threads n] -o output.dds (input.dds | +x -x +y -y +z -z)\n"
+            "faces are PFM (HDR) or binary PPM (LDR); the default format is bc6h for\n"
+            "HDR sources and bc7 otherwise\n");
+}
+
+int main(int argc, char ** argv)
+{
+    const char * formatName = NULL;
+    const char * output = NULL;
+    Quality quality = QUALITY_NORMAL;
+    bool forceSrgb = false;
+    int threads = 0;
+    std::vector<char*> inputs;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "-format") && i + 1 < argc)
+            formatName = argv[++i];
+        else if(!strcmp(argv[i], "-quality") && i + 1 < argc)
+        {
+            const char * q = argv[++i];
+            if(!strcmp(q, "fast"))
+                quality = QUALITY_FAST;
+            else if(!strcmp(q, "normal"))
+                quality = QUALITY_NORMAL;
+            else if(!strcmp(q, "high"))
+                quality = QUALITY_HIGH;
+            else
+            {
+                Usage();
+                return 2;
+            }
+        }
+        else if(!strcmp(argv[i], "-srgb"))
+            forceSrgb = true;
+        else if(!strcmp(argv[i], "-threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else
+            inputs.push_back(argv[i]);
+    }
+    if(!output || (inputs.size() != 1 && inputs.size() != FACES))
+    {
+        Usage();
+        return 2;
+    }
+
+    for(int i = 0; i < 16; ++i)
+        bc4BitWeights[i] = bcWeights4[i] / 64.0f;
+
+    Cube cube;
+    cube.hdr = false;
+    if(!(inputs.size() == 1 ? LoadDDS(inputs[0], &cube) : LoadFaces(&inputs[0], &cube)))
+        return 1;
+    cube.srgb = cube.srgb || forceSrgb;
+    if(!formatName)
+        formatName = cube.hdr ? "bc6h" : "bc7";
+    const Codec * codec = NULL;
+    for(size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); ++i)
+        if(!strcmp(codecs[i].name, formatName))
+            codec = &codecs[i];
+    if(!codec)
+    {
+        Usage();
+        return 2;
+    }
+    if(codec->format == DXGI_FORMAT_BC6H_UF16)
+        cube.srgb = false;
+    else if(cube.hdr)
+        printf("ReefTex: warning: HDR source clamped to [0, 1] for %s\n", codec->name);
+
+    InitJobs(threads);
+    double start = GetSeconds();
+    BuildMips(&cube);
+    double mipTime = GetSeconds() - start;
+
+    EncodeContext context;
+    context.codec = codec;
+    context.cube = &cube;
+    context.quality = quality;
+    int blocks = 0;
+    size_t offset = 0;
+    for(int f = 0; f < FACES; ++f)
+    {
+        for(int level = 0; level < cube.levels; ++level)
+        {
+            Region region;
+            region.face = f;
+            region.level = level;
+            region.firstBlock = blocks;
+            region.offset = offset;
+            region.squaredError = 0;
+            region.samples = 0;
+            context.regions.push_back(region);
+            int n = LevelBlocks(cube.faces[f][level].size);
+            blocks += n * n;
+            offset += (size_t)n * n * codec->blockBytes;
+        }
+    }
+    context.data.assign(offset, 0);
+
+    start = GetSeconds();
+    ParallelFor(blocks, 0, EncodeBlocks, &context);
+    double encodeTime = GetSeconds() - start;
+    ParallelFor((int)context.regions.size(), 1, MeasureRegions, &context);
+
+    static const char * qualityNames[] = { "fast", "normal", "high" };
+    int size = cube.faces[0][0].size;
+    printf("ReefTex: %d x %d cube, %d levels, %s %s%s, %d threads\n", size, size, cube.levels,
+           codec->name, qualityNames[quality], cube.srgb ? " srgb" : "", GetJobWorkerCount());
+    printf("ReefTex: mips %.3f s, encode %.3f s, %d blocks, %.2f Mblocks/s\n",
+           mipTime, encodeTime, blocks, blocks / encodeTime * 1e-6);
+    double totalError = 0, totalSamples = 0;
+    for(int level = 0; level < cube.levels; ++level)
+    {
+        double error = 0, samples = 0;
+        for(size_t r = 0; r < context.regions.size(); ++r)
+        {
+            if(context.regions[r].level != level)
+                continue;
+            error += context.regions[r].squaredError;
+            samples += context.regions[r].samples;
+        }
+        totalError += error;
+        totalSamples += samples;
+        int s = cube.faces[0][level].size;
+        printf("ReefTex: level %2d %5d x %-5d %s %6.2f dB\n", level, s, s,
+               codec->range > 255 ? "mPSNR" : "PSNR", Psnr(error, samples));
+    }
+    printf("ReefTex: overall %s %.2f dB, %lu source bytes -> %lu bytes\n",
+           codec->range > 255 ? "mPSNR" : "PSNR", Psnr(totalError, totalSamples),
+           (unsigned long)cube.sourceBytes, (unsigned long)context.data.size());
+
+    bool ok = WriteDDS(output, *codec, cube, context.data);
+    ShutdownJobs();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,40 @@
+#include "ToolFiles.h"
+
+#include <ctype.h>
+#include <stdio.h>
+
+bool ReadFile(const char * tool, const char * filename, std::vector<unsigned char> * data)
+{
+    FILE * file = fopen(filename, "rb");
+    if(!file)
+    {
+        fprintf(stderr, "%s: unable to open %s\n", tool, filename);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data->resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&(*data)[0], 1, size, file) == (size_t)size;
+    fclose(file);
+    if(!ok)
+        fprintf(stderr, "%s: unable to read %s\n", tool, filename);
+    return ok;
+}
+
+bool ReadToken(const std::vector<unsigned char> & data, size_t * pos, char * token, int size)
+{
+    while(*pos < data.size() && (isspace(data[*pos]) || data[*pos] == '#'))
+    {
+        if(data[*pos] == '#')
+            while(*pos < data.size() && data[*pos] != '\n')
+                ++*pos;
+        else
+            ++*pos;
+    }
+    int n = 0;
+    while(*pos < data.size() && !isspace(data[*pos]) && n < size - 1)
+        token[n++] = data[(*pos)++];
+    token[n] = 0;
+    return n > 0;
+}
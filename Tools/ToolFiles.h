@@ -0,0 +1,14 @@
+#ifndef REEF_TOOL_FILES_H
+#define REEF_TOOL_FILES_H
+
+#include <stddef.h>
+#include <vector>
+
+// File reading shared by the offline tools. Failures are reported on stderr
+// prefixed with the tool's name.
+
+bool ReadFile(const char * tool, const char * filename, std::vector<unsigned char> * data);
+// Next token of a PPM or PFM header, skipping white space and # comments.
+bool ReadToken(const std::vector<unsigned char> & data, size_t * pos, char * token, int size);
+
+#endif
@@ -0,0 +1,269 @@
+#include "Wake.h"
+#include "Jobs.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define WAKE_SSE
+#include <xmmintrin.h>
+#endif
+
+#define WAKE_SPONGE_STRENGTH 0.2f
+
+float WakeCourantNumber(const WakeParams & params, float timestep)
+{
+    return params.speed * timestep / params.cellSize;
+}
+
+bool IsWakeStable(const WakeParams & params, float timestep)
+{
+    float c = WakeCourantNumber(params, timestep);
+    return c > 0 && c <= 0.70710678f
+           && params.damping * timestep < 1;
+}
+
+bool CreateWake(Wake * wake, const WakeParams & params, float timestep)
+{
+    memset(wake, 0, sizeof(Wake));
+    if(params.cells < WAKE_TILE || params.cells % WAKE_TILE
+       || params.spongeCells < 1 || params.spongeCells * 2 >= params.cells
+       || !IsWakeStable(params, timestep))
+        return false;
+
+    int n = params.cells;
+    wake->params = params;
+    wake->timestep = timestep;
+    float c = WakeCourantNumber(params, timestep);
+    wake->laplacianFactor = c * c;
+    wake->friction = 1 - params.damping * timestep;
+    wake->height = (float*)AllocAligned(n * n * sizeof(float), 16);
+    wake->previous = (float*)AllocAligned(n * n * sizeof(float), 16);
+    wake->sponge = (float*)AllocAligned(n * sizeof(float), 16);
+    if(!wake->height || !wake->previous || !wake->sponge)
+    {
+        DestroyWake(wake);
+        return false;
+    }
+
+    for(int i = 0; i < n; ++i)
+    {
+        int d = i < n - 1 - i ? i : n - 1 - i;
+        if(d == 0)
+            wake->sponge[i] = 0;
+        else if(d < params.spongeCells)
+        {
+            float t = 1 - d / (float)params.spongeCells;
+            wake->sponge[i] = 1 - WAKE_SPONGE_STRENGTH * t * t;
+        }
+        else
+            wake->sponge[i] = 1;
+    }
+    ClearWake(wake);
+    return true;
+}
+
+void DestroyWake(Wake * wake)
+{
+    if(wake->height)
+        FreeAligned(wake->height);
+    if(wake->previous)
+        FreeAligned(wake->previous);
+    if(wake->sponge)
+        FreeAligned(wake->sponge);
+    memset(wake, 0, sizeof(Wake));
+}
+
+void ClearWake(Wake * wake)
+{
+    int n = wake->params.cells;
+    memset(wake->height, 0, n * n * sizeof(float));
+    memset(wake->previous, 0, n * n * sizeof(float));
+}
+
+static void ShiftCells(float * cells, int n, int di, int dj)
+{
+    if(di <= -n || di >= n || dj <= -n || dj >= n)
+    {
+        memset(cells, 0, n * n * sizeof(float));
+        return;
+    }
+    int first = dj > 0 ? 0 : n - 1;
+    int step = dj > 0 ? 1 : -1;
+    for(int j = first; j >= 0 && j < n; j += step)
+    {
+        float * dst = cells + j * n;
+        int src = j + dj;
+        if(src < 0 || src >= n)
+        {
+            memset(dst, 0, n * sizeof(float));
+            continue;
+        }
+        float * row = cells + src * n;
+        if(di >= 0)
+        {
+            memmove(dst, row + di, (n - di) * sizeof(float));
+            memset(dst + n - di, 0, di * sizeof(float));
+        }
+        else
+        {
+            memmove(dst - di, row, (n + di) * sizeof(float));
+            memset(dst, 0, -di * sizeof(float));
+        }
+    }
+    // the outer ring is a fixed zero boundary
+    memset(cells, 0, n * sizeof(float));
+    memset(cells + (n - 1) * n, 0, n * sizeof(float));
+    for(int j = 1; j < n - 1; ++j)
+        cells[j * n] = cells[j * n + n - 1] = 0;
+}
+
+void CenterWake(Wake * wake, float x, float z)
+{
+    int half = wake->params.cells / 2;
+    int ox = (int)floorf(x / wake->params.cellSize) - half;
+    int oz = (int)floorf(z / wake->params.cellSize) - half;
+    int di = ox - wake->originX;
+    int dj = oz - wake->originZ;
+    if(!di && !dj)
+        return;
+    ShiftCells(wake->height, wake->params.cells, di, dj);
+    ShiftCells(wake->previous, wake->params.cells, di, dj);
+    wake->originX = ox;
+    wake->originZ = oz;
+}
+
+void DisturbWake(Wake * wake, float x, float z, float radius, float strength)
+{
+    int n = wake->params.cells;
+    float dx = wake->params.cellSize;
+    float cx = x / dx - wake->originX;
+    float cz = z / dx - wake->originZ;
+    float r = radius / dx;
+    int i0 = (int)floorf(cx - 2 * r), i1 = (int)ceilf(cx + 2 * r);
+    int j0 = (int)floorf(cz - 2 * r), j1 = (int)ceilf(cz + 2 * r);
+    if(i0 < 1) i0 = 1;
+    if(j0 < 1) j0 = 1;
+    if(i1 > n - 2) i1 = n - 2;
+    if(j1 > n - 2) j1 = n - 2;
+    float invR2 = 1 / (r * r);
+    for(int j = j0; j <= j1; ++j)
+    {
+        for(int i = i0; i <= i1; ++i)
+        {
+            float d2 = ((i - cx) * (i - cx) + (j - cz) * (j - cz)) * invR2;
+            wake->height[j * n + i] += strength * expf(-d2);
+        }
+    }
+}
+
+// h' = sponge * (h + friction * (h - h_prev) + k * laplacian(h)), written
+// over h_prev so that the two buffers ping-pong between steps.
+static void StepTile(Wake * wake, int x0, int x1, int y0, int y1)
+{
+    int n = wake->params.cells;
+    const float * h = wake->height;
+    float * p = wake->previous;
+    const float * sponge = wake->sponge;
+    float k = wake->laplacianFactor;
+    float f = wake->friction;
+#ifdef WAKE_SSE
+    __m128 kv = _mm_set1_ps(k);
+    __m128 fv = _mm_set1_ps(f);
+    __m128 four = _mm_set1_ps(4.0f);
+    for(int y = y0; y < y1; ++y)
+    {
+        __m128 sy = _mm_set1_ps(sponge[y]);
+        for(int x = x0; x < x1; x += 4)
+        {
+            int o = y * n + x;
+            __m128 c = _mm_load_ps(h + o);
+            __m128 lap = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(h + o - 1),
+                                               _mm_loadu_ps(h + o + 1)),
+                                    _mm_add_ps(_mm_load_ps(h + o - n),
+                                               _mm_load_ps(h + o + n)));
+            lap = _mm_sub_ps(lap, _mm_mul_ps(four, c));
+            __m128 v = _mm_mul_ps(fv, _mm_sub_ps(c, _mm_load_ps(p + o)));
+            __m128 r = _mm_add_ps(_mm_add_ps(c, v), _mm_mul_ps(kv, lap));
+            r = _mm_mul_ps(r, _mm_mul_ps(sy, _mm_load_ps(sponge + x)));
+            _mm_store_ps(p + o, r);
+        }
+    }
+#else
+    for(int y = y0; y < y1; ++y)
+    {
+        for(int x = x0; x < x1; ++x)
+        {
+            int o = y * n + x;
+            float c = h[o];
+            float lap = h[o - 1] + h[o + 1] + h[o - n] + h[o + n] - 4 * c;
+            p[o] = (c + f * (c - p[o]) + k * lap) * sponge[y] * sponge[x];
+        }
+    }
+#endif
+}
+
+static void StepTiles(void * context, int begin, int end)
+{
+    Wake * wake = (Wake*)context;
+    int n = wake->params.cells;
+    int tilesX = n / WAKE_TILE;
+    for(int t = begin; t < end; ++t)
+    {
+        int x0 = (t % tilesX) * WAKE_TILE;
+        int y0 = (t / tilesX) * WAKE_TILE;
+        int y1 = y0 + WAKE_TILE;
+        // rows 0 and n - 1 are the fixed boundary; the kernel reads one row
+        // above and below and one cell past either end of a row
+        StepTile(wake, x0, x0 + WAKE_TILE, y0 > 0 ? y0 : 1, y1 < n ? y1 : n - 1);
+    }
+}
+
+void StepWake(Wake * wake)
+{
+    int tiles = wake->params.cells / WAKE_TILE;
+    ParallelFor(tiles * tiles, 1, StepTiles, wake);
+    float * tmp = wake->height;
+    wake->height = wake->previous;
+    wake->previous = tmp;
+}
+
+float SampleWake(const Wake * wake, float x, float z)
+{
+    int n = wake->params.cells;
+    float fx = x / wake->params.cellSize - wake->originX;
+    float fz = z / wake->params.cellSize - wake->originZ;
+    if(fx < 0 || fz < 0 || fx >= n - 1 || fz >= n - 1)
+        return 0;
+    int i = (int)fx, j = (int)fz;
+    fx -= i;
+    fz -= j;
+    const float * h = wake->height + j * n + i;
+    float a = h[0] + (h[1] - h[0]) * fx;
+    float b = h[n] + (h[n + 1] - h[n]) * fx;
+    return a + (b - a) * fz;
+}
+
+float WakeEnergy(const Wake * wake)
+{
+    int n = wake->params.cells;
+    double e = 0;
+    for(int o = 0; o < n * n; ++o)
+    {
+        float h = wake->height[o];
+        float v = h - wake->previous[o];
+        e += h * h + v * v / wake->laplacianFactor;
+    }
+    return (float)e;
+}
+
+float WakeOriginX(const Wake * wake)
+{
+    return wake->originX * wake->params.cellSize;
+}
+
+float WakeOriginZ(const Wake * wake)
+{
+    return wake->originZ * wake->params.cellSize;
+}
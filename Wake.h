@@ -0,0 +1,56 @@
+#ifndef REEF_WAKE_H
+#define REEF_WAKE_H
+
+// Local wave-equation height field that follows the camera and carries
+// ripples and wakes left by objects on top of the Gerstner surface.
+
+#define WAKE_TILE 64
+#define WAKE_CELLS 256
+#define WAKE_CELL_SIZE (1.0f / 64)
+#define WAKE_SPEED 0.5f
+#define WAKE_DAMPING 0.5f
+#define WAKE_SPONGE 16
+#define WAKE_TIMESTEP (1.0f / 60)
+#define WAKE_MAX_SUBSTEPS 4
+
+struct WakeParams
+{
+    int cells;
+    float cellSize;
+    float speed;
+    float damping;
+    int spongeCells;
+};
+
+struct Wake
+{
+    WakeParams params;
+    float timestep;
+    float laplacianFactor;
+    float friction;
+    float * height;
+    float * previous;
+    float * sponge;
+    int originX;
+    int originZ;
+};
+
+// Courant number c*dt/dx; the explicit 2D scheme is stable up to 1/sqrt(2).
+float WakeCourantNumber(const WakeParams & params, float timestep);
+bool IsWakeStable(const WakeParams & params, float timestep);
+
+bool CreateWake(Wake * wake, const WakeParams & params, float timestep);
+void DestroyWake(Wake * wake);
+void ClearWake(Wake * wake);
+
+// Scrolls the grid by whole cells so that it stays centered on (x, z).
+void CenterWake(Wake * wake, float x, float z);
+void DisturbWake(Wake * wake, float x, float z, float radius, float strength);
+void StepWake(Wake * wake);
+
+float SampleWake(const Wake * wake, float x, float z);
+float WakeEnergy(const Wake * wake);
+float WakeOriginX(const Wake * wake);
+float WakeOriginZ(const Wake * wake);
+
+#endif
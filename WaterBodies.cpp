@@ -0,0 +1,263 @@
+#include "WaterBodies.h"
+#include "FrameArena.h"
+#include "Jobs.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define WATER_SSE
+#include <xmmintrin.h>
+#endif
+
+bool CreateWaterBodies(WaterBodies * bodies, int capacity, int waveCapacity)
+{
+    memset(bodies, 0, sizeof(WaterBodies));
+    if(capacity <= 0 || waveCapacity <= 0)
+        return false;
+    int padded = (capacity + 3) & ~3;
+    bodies->capacity = capacity;
+    bodies->waveCapacity = waveCapacity;
+    bodies->waves = (Wave*)malloc(waveCapacity * sizeof(Wave));
+    bodies->instances = (WaterInstance*)malloc(capacity * sizeof(WaterInstance));
+    bodies->localRadius = (float*)AllocAligned(padded * sizeof(float), 16);
+    bodies->centerX = (float*)AllocAligned(padded * sizeof(float), 16);
+    bodies->centerY = (float*)AllocAligned(padded * sizeof(float), 16);
+    bodies->centerZ = (float*)AllocAligned(padded * sizeof(float), 16);
+    bodies->radius = (float*)AllocAligned(padded * sizeof(float), 16);
+    if(!bodies->waves || !bodies->instances || !bodies->localRadius || !bodies->centerX
+       || !bodies->centerY || !bodies->centerZ || !bodies->radius)
+    {
+        DestroyWaterBodies(bodies);
+        return false;
+    }
+    for(int i = 0; i < padded; ++i)
+    {
+        bodies->localRadius[i] = 0;
+        bodies->centerX[i] = bodies->centerY[i] = bodies->centerZ[i] = 0;
+        bodies->radius[i] = 0;
+    }
+    return true;
+}
+
+void DestroyWaterBodies(WaterBodies * bodies)
+{
+    free(bodies->waves);
+    free(bodies->instances);
+    if(bodies->localRadius)
+        FreeAligned(bodies->localRadius);
+    if(bodies->centerX)
+        FreeAligned(bodies->centerX);
+    if(bodies->centerY)
+        FreeAligned(bodies->centerY);
+    if(bodies->centerZ)
+        FreeAligned(bodies->centerZ);
+    if(bodies->radius)
+        FreeAligned(bodies->radius);
+    memset(bodies, 0, sizeof(WaterBodies));
+}
+
+// largest distance a Gerstner vertex can move: the amplitudes vertically and
+// q * amp = crestFactor / (freq * n) per wave horizontally
+static float WaveDisplacement(const Wave * waves, int n, float crestFactor)
+{
+    float vertical = 0, horizontal = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        float freq = sqrtf(WAVE_G * 2 * WAVE_PI / waves[i].length);
+        vertical += fabsf(waves[i].amp);
+        horizontal += fabsf(crestFactor) / (freq * n);
+    }
+    return sqrtf(vertical * vertical + horizontal * horizontal);
+}
+
+void SetWaterBodyTransform(WaterBodies * bodies, int body, const float transform[3][4])
+{
+    WaterInstance & instance = bodies->instances[body];
+    memcpy(instance.transform, transform, sizeof(instance.transform));
+    // cofactors of the linear part are the inverse transpose times the
+    // determinant; only its sign matters once the shader normalizes
+    const float (*m)[4] = transform;
+    float (*n)[3] = instance.normalTransform;
+    n[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    n[0][1] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    n[0][2] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    n[1][0] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+    n[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+    n[1][2] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+    n[2][0] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+    n[2][1] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+    n[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+    if(m[0][0] * n[0][0] + m[0][1] * n[0][1] + m[0][2] * n[0][2] < 0)
+        for(int r = 0; r < 3; ++r)
+            for(int c = 0; c < 3; ++c)
+                n[r][c] = -n[r][c];
+    float scale = 0;
+    for(int c = 0; c < 3; ++c)
+    {
+        float s = sqrtf(transform[0][c] * transform[0][c] + transform[1][c] * transform[1][c]
+                        + transform[2][c] * transform[2][c]);
+        scale = s > scale ? s : scale;
+    }
+    instance.scale = scale;
+    bodies->centerX[body] = transform[0][3];
+    bodies->centerY[body] = transform[1][3];
+    bodies->centerZ[body] = transform[2][3];
+    bodies->radius[body] = bodies->localRadius[body] * scale;
+}
+
+int AddWaterBody(WaterBodies * bodies, const WaterBodyDesc & desc)
+{
+    if(bodies->count >= bodies->capacity || desc.waveCount < 0
+       || bodies->waveCount + desc.waveCount > bodies->waveCapacity)
+        return -1;
+    int body = bodies->count++;
+    Wave * waves = bodies->waves + bodies->waveCount;
+    memcpy(waves, desc.waves, desc.waveCount * sizeof(Wave));
+    SortWavesByLength(waves, desc.waveCount);
+
+    WaterInstance & instance = bodies->instances[body];
+    instance.waveOffset = bodies->waveCount;
+    instance.waveCount = desc.waveCount;
+    instance.crestFactor = desc.crestFactor;
+    instance.material = desc.material;
+    bodies->waveCount += desc.waveCount;
+    bodies->localRadius[body] = desc.meshRadius
+                                + WaveDisplacement(waves, desc.waveCount, desc.crestFactor);
+    SetWaterBodyTransform(bodies, body, desc.transform);
+    return body;
+}
+
+void ExtractWaterFrustum(const float viewProjection[4][4], WaterFrustum * frustum)
+{
+    // each plane is a sum or difference of clip space columns
+    static const int column[6] = { 0, 0, 1, 1, 2, 2 };
+    static const float sign[6] = { 1, -1, 1, -1, 1, -1 };
+    static const float w[6] = { 1, 1, 1, 1, 0, 1 };
+    for(int p = 0; p < 6; ++p)
+    {
+        float * plane = frustum->planes[p];
+        for(int r = 0; r < 4; ++r)
+            plane[r] = w[p] * viewProjection[r][3] + sign[p] * viewProjection[r][column[p]];
+        float length = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        if(length > 0)
+            for(int r = 0; r < 4; ++r)
+                plane[r] /= length;
+    }
+}
+
+struct CullContext
+{
+    const WaterBodies * bodies;
+    const WaterFrustum * frustum;
+    unsigned char * masks;
+    int * chunkCounts;
+    WaterInstance * instances;
+};
+
+static const int bitCounts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+// one visibility bit per body, four bodies to a mask
+static void CullChunks(void * data, int begin, int end)
+{
+    CullContext * context = (CullContext*)data;
+    const WaterBodies * bodies = context->bodies;
+    const float (*planes)[4] = context->frustum->planes;
+    for(int chunk = begin; chunk < end; ++chunk)
+    {
+        int first = chunk * WATER_CULL_CHUNK;
+        int last = first + WATER_CULL_CHUNK < bodies->count ? first + WATER_CULL_CHUNK : bodies->count;
+        int visible = 0;
+        for(int b = first; b < last; b += 4)
+        {
+#ifdef WATER_SSE
+            __m128 x = _mm_load_ps(bodies->centerX + b);
+            __m128 y = _mm_load_ps(bodies->centerY + b);
+            __m128 z = _mm_load_ps(bodies->centerZ + b);
+            __m128 r = _mm_load_ps(bodies->radius + b);
+            __m128 negR = _mm_sub_ps(_mm_setzero_ps(), r);
+            __m128 inside = _mm_cmpeq_ps(r, r);
+            for(int p = 0; p < 6; ++p)
+            {
+                __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[p][0])),
+                                                 _mm_mul_ps(y, _mm_set1_ps(planes[p][1]))),
+                                      _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[p][2])),
+                                                 _mm_set1_ps(planes[p][3])));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negR));
+            }
+            int mask = _mm_movemask_ps(inside);
+#else
+            int mask = 0;
+            for(int l = 0; l < 4; ++l)
+            {
+                bool in = true;
+                for(int p = 0; p < 6 && in; ++p)
+                    in = planes[p][0] * bodies->centerX[b + l] + planes[p][1] * bodies->centerY[b + l]
+                         + planes[p][2] * bodies->centerZ[b + l] + planes[p][3] >= -bodies->radius[b + l];
+                mask |= in << l;
+            }
+#endif
+            // drop the padding past the last body
+            if(last - b < 4)
+                mask &= (1 << (last - b)) - 1;
+            context->masks[b >> 2] = (unsigned char)mask;
+            visible += bitCounts[mask];
+        }
+        context->chunkCounts[chunk] = visible;
+    }
+}
+
+static void GatherChunks(void * data, int begin, int end)
+{
+    CullContext * context = (CullContext*)data;
+    const WaterBodies * bodies = context->bodies;
+    for(int chunk = begin; chunk < end; ++chunk)
+    {
+        WaterInstance * out = context->instances + context->chunkCounts[chunk];
+        int first = chunk * WATER_CULL_CHUNK;
+        int last = first + WATER_CULL_CHUNK < bodies->count ? first + WATER_CULL_CHUNK : bodies->count;
+        for(int b = first; b < last; b += 4)
+        {
+            int mask = context->masks[b >> 2];
+            for(int l = 0; mask; ++l, mask >>= 1)
+                if(mask & 1)
+                    *out++ = bodies->instances[b + l];
+        }
+    }
+}
+
+int CullWaterBodies(const WaterBodies * bodies, const WaterFrustum & frustum,
+                    WaterInstance ** instances)
+{
+    *instances = NULL;
+    if(!bodies->count)
+        return 0;
+    int chunks = (bodies->count + WATER_CULL_CHUNK - 1) / WATER_CULL_CHUNK;
+    CullContext context;
+    context.bodies = bodies;
+    context.frustum = &frustum;
+    context.masks = (unsigned char*)FrameAlloc((bodies->count + 3) / 4);
+    context.chunkCounts = (int*)FrameAlloc(chunks * sizeof(int));
+    context.instances = NULL;
+    if(!context.masks || !context.chunkCounts)
+        return 0;
+    ParallelFor(chunks, 1, CullChunks, &context);
+
+    // chunk counts become the chunks' first output slots
+    int visible = 0;
+    for(int chunk = 0; chunk < chunks; ++chunk)
+    {
+        int n = context.chunkCounts[chunk];
+        context.chunkCounts[chunk] = visible;
+        visible += n;
+    }
+    if(!visible)
+        return 0;
+    context.instances = (WaterInstance*)FrameAlloc(visible * sizeof(WaterInstance));
+    if(!context.instances)
+        return 0;
+    ParallelFor(chunks, 1, GatherChunks, &context);
+    *instances = context.instances;
+    return visible;
+}
@@ -0,0 +1,92 @@
+#ifndef REEF_WATER_BODIES_H
+#define REEF_WATER_BODIES_H
+
+#include "Waves.h"
+
+// Many independent water surfaces drawn as instances of one mesh. Every
+// body's wave set lives in one shared, packed wave buffer and each instance
+// carries the offset and count of its waves along with its transform and
+// material. Bodies are culled on the CPU against the view frustum and the
+// visible instances are gathered into the current frame arena.
+
+#define WATER_CULL_CHUNK 256
+
+struct WaterMaterial
+{
+    float color[3];
+    float reflectivity;
+    float transmittance;
+    float fresnelScale;
+    float fresnelBias;
+    float fresnelPower;
+};
+
+// per-instance vertex data, laid out the way WaterVS reads it; transform
+// maps local (x, y, z, 1) to world space one row per output coordinate and
+// normalTransform is its inverse transpose up to a positive scale, so normals
+// stay perpendicular to the surface under non-uniform scale
+struct WaterInstance
+{
+    float transform[3][4];
+    float normalTransform[3][3];
+    unsigned waveOffset;
+    unsigned waveCount;
+    float crestFactor;
+    float scale;
+    WaterMaterial material;
+};
+
+struct WaterBodyDesc
+{
+    const Wave * waves;
+    int waveCount;
+    float crestFactor;
+    // radius of the flat mesh around the local origin
+    float meshRadius;
+    float transform[3][4];
+    WaterMaterial material;
+};
+
+struct WaterBodies
+{
+    int count;
+    int capacity;
+    int waveCount;
+    int waveCapacity;
+    // waves below this index have been copied to the GPU; bodies are only
+    // ever appended, so the rest is what still needs uploading
+    int uploadedWaveCount;
+    Wave * waves;
+    WaterInstance * instances;
+    float * localRadius;
+    // world bounding spheres, one array per component, padded to SIMD width
+    float * centerX;
+    float * centerY;
+    float * centerZ;
+    float * radius;
+};
+
+// planes (a, b, c, d) with a * x + b * y + c * z + d >= 0 inside
+struct WaterFrustum
+{
+    float planes[6][4];
+};
+
+bool CreateWaterBodies(WaterBodies * bodies, int capacity, int waveCapacity);
+void DestroyWaterBodies(WaterBodies * bodies);
+
+// Returns the index of the new body or -1 when either buffer is full. The
+// body's waves are copied and sorted longest first for band limiting.
+int AddWaterBody(WaterBodies * bodies, const WaterBodyDesc & desc);
+void SetWaterBodyTransform(WaterBodies * bodies, int body, const float transform[3][4]);
+
+// viewProjection is row-major and transforms row vectors, clip = p * M,
+// with D3D clip space depth in [0, w]
+void ExtractWaterFrustum(const float viewProjection[4][4], WaterFrustum * frustum);
+
+// Allocates the visible instances from the current frame arena and returns
+// their count; *instances is NULL when nothing is visible.
+int CullWaterBodies(const WaterBodies * bodies, const WaterFrustum & frustum,
+                    WaterInstance ** instances);
+
+#endif
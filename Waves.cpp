@@ -0,0 +1,98 @@
+#include "Waves.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+static bool LongerWave(const Wave & a, const Wave & b)
+{
+    return a.length > b.length;
+}
+
+void SortWavesByLength(Wave * waves, int n)
+{
+    std::stable_sort(waves, waves + n, LongerWave);
+}
+
+float WaveCutoff(const WaveBand & band, float distance)
+{
+    float c = distance * band.scale;
+    return c > band.nyquist ? c : band.nyquist;
+}
+
+int LoadWaves(const char * filename, Wave * waves, int capacity)
+{
+    FILE * file = fopen(filename, "r");
+    if(!file)
+        return -1;
+    int n = 0;
+    char line[256];
+    while(fgets(line, sizeof(line), file))
+    {
+        char * comment = strchr(line, '#');
+        if(comment)
+            *comment = 0;
+        char * p = line + strspn(line, " \t\r\n");
+        if(!*p)
+            continue;
+        Wave wave;
+        char extra;
+        int fields = sscanf(p, "%f %f %f %f %c", &wave.dir.x, &wave.dir.y, &wave.length,
+                            &wave.amp, &extra);
+        // zero amplitude would divide by zero in the crest factor term
+        if(fields != 4 || n >= capacity || !(wave.length > 0) || !(wave.amp > 0))
+        {
+            n = -1;
+            break;
+        }
+        waves[n++] = wave;
+    }
+    fclose(file);
+    return n;
+}
+
+int GerstnerWaveSum(const Wave * waves, int n, float crestFactor, float time,
+                    float x, float z, float cutoff, WaveSum * sum)
+{
+    float px = 0, py = 0, pz = 0;
+    float nx = 0, ny = 0, nz = 0;
+    int i = 0;
+    for(; i < n; ++i)
+    {
+        const Wave & wave = waves[i];
+        float fade = 1;
+        if(cutoff > 0)
+        {
+            if(wave.length <= cutoff)
+                break;
+            fade = wave.length / cutoff - 1;
+            if(fade > 1)
+                fade = 1;
+        }
+        float freq = sqrtf(WAVE_G * 2 * WAVE_PI / wave.length);
+        float q = 1 / (wave.amp * freq * n) * crestFactor;
+        float phase = freq * (wave.dir.x * x + wave.dir.y * z) + WAVE_PHASE * time;
+        float s = sinf(phase);
+        float c = cosf(phase);
+        float amp = wave.amp * fade;
+        float tmp = q * amp * c;
+        px += tmp * wave.dir.x;
+        py += amp * s;
+        pz += tmp * wave.dir.y;
+        nx += wave.dir.x * freq * amp * c;
+        ny += q * freq * amp * s;
+        nz += wave.dir.y * freq * amp * c;
+    }
+    sum->pos[0] = px + x;
+    sum->pos[1] = py;
+    sum->pos[2] = pz + z;
+    nx = -nx;
+    ny = 1 - ny;
+    nz = -nz;
+    float len = sqrtf(nx * nx + ny * ny + nz * nz);
+    sum->norm[0] = nx / len;
+    sum->norm[1] = ny / len;
+    sum->norm[2] = nz / len;
+    return i;
+}
@@ -0,0 +1,51 @@
+#ifndef REEF_WAVES_H
+#define REEF_WAVES_H
+
+// CPU mirror of the Gerstner evaluation in Reef.hlsl.
+
+#define WAVE_PI 3.14159265f
+#define WAVE_G 9.8f
+#define WAVE_PHASE (WAVE_PI * 2)
+
+struct Float2
+{
+    float x;
+    float y;
+};
+
+struct Wave
+{
+    Float2 dir;
+    float length;
+    float amp;
+};
+
+struct WaveSum
+{
+    float pos[3];
+    float norm[3];
+};
+
+// Band limit: waves shorter than the cutoff are dropped and waves up to twice
+// the cutoff fade out. The cutoff is the larger of the mesh Nyquist length
+// and the wavelength spanning a few pixels at the given distance.
+struct WaveBand
+{
+    float nyquist;
+    float scale;
+};
+
+// Sorts waves longest first, the order GerstnerWaveSum relies on to stop early.
+void SortWavesByLength(Wave * waves, int n);
+float WaveCutoff(const WaveBand & band, float distance);
+
+// Reads a wave file with one "dirX dirZ length amp" record per line; '#'
+// starts a comment. Returns the number of waves read, or -1 when the file is
+// missing, malformed or holds more than capacity waves.
+int LoadWaves(const char * filename, Wave * waves, int capacity);
+
+// Returns the number of waves evaluated; cutoff <= 0 evaluates all n.
+int GerstnerWaveSum(const Wave * waves, int n, float crestFactor, float time,
+                    float x, float z, float cutoff, WaveSum * sum);
+
+#endif